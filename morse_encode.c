@@ -0,0 +1,128 @@
+#include <string.h>
+
+#include "morse_encode.h"
+#include "morsecode_table.h"
+
+#define BITS_IN_A_BYTE 8
+#define BITS_IN_A_CODE 16
+
+// The encoder is a table-driven state machine. For every (state, byte)
+// pair the tables give the bits to append and the next state, so the inner
+// loop looks each character up instead of classifying it; the only branch
+// left is the flush of each full 32-bit word.
+enum {
+	STATE_START,            // nothing flashed yet
+	STATE_IN_WORD,          // last kept character was a letter
+	STATE_AFTER_SPACE,      // a space was seen since the last letter
+	NR_STATES
+};
+
+struct code_entry {
+	uint32_t bits;          // right-aligned
+	uint32_t length;
+};
+
+static struct code_entry code_table[NR_STATES][256];
+static uint8_t next_state_table[NR_STATES][256];
+
+static unsigned int code_length(unsigned short morsecode_bits)
+{
+	return BITS_IN_A_CODE - __builtin_ctz(morsecode_bits);
+}
+
+__attribute__((constructor))
+static void build_tables(void)
+{
+	int state;
+	int ch;
+
+	for (state = 0; state < NR_STATES; ++state) {
+		for (ch = 0; ch < 256; ++ch) {
+			struct code_entry *entry = &code_table[state][ch];
+			unsigned short morsecode_bits;
+			unsigned int length;
+			unsigned int gap = 0;
+
+			if (ch == ' ') {
+				next_state_table[state][ch] =
+				    state == STATE_START ? STATE_START : STATE_AFTER_SPACE;
+				continue;
+			}
+			if (!(('a' <= ch && ch <= 'z') || ('A' <= ch && ch <= 'Z'))) {
+				next_state_table[state][ch] = state;
+				continue;
+			}
+			next_state_table[state][ch] = STATE_IN_WORD;
+
+			// Letter gap, plus the rest of the word gap after a space; the
+			// trailing off dot of the previous letter makes up the remainder.
+			if (state == STATE_IN_WORD) {
+				gap = INTER_LETTER_DOTTIMES - 1;
+			} else if (state == STATE_AFTER_SPACE) {
+				gap = INTER_WORD_DOTTIMES - 1;
+			}
+			morsecode_bits = letter_to_morsecode_bits_map[(ch | 0x20) - 'a'];
+			length = code_length(morsecode_bits);
+			entry->bits = (uint32_t)(morsecode_bits >> (BITS_IN_A_CODE - length)) << 1;
+			entry->length = gap + length + 1;
+		}
+	}
+}
+
+size_t morse_encoded_bits(const char *text, size_t len)
+{
+	const unsigned char *in = (const unsigned char *)text;
+	size_t total = 0;
+	unsigned int state = STATE_START;
+	size_t idx;
+
+	for (idx = 0; idx < len; ++idx) {
+		total += code_table[state][in[idx]].length;
+		state = next_state_table[state][in[idx]];
+	}
+	return total;
+}
+
+static void store_be32(uint8_t *out, uint32_t value)
+{
+	out[0] = value >> 24;
+	out[1] = value >> 16;
+	out[2] = value >> 8;
+	out[3] = value;
+}
+
+size_t morse_encode(const char *text, size_t len, uint8_t *out)
+{
+	const unsigned char *in = (const unsigned char *)text;
+	uint64_t acc = 0;           // pending bits, right-aligned
+	unsigned int acc_bits = 0;  // always < 32 between characters
+	unsigned int state = STATE_START;
+	size_t total = 0;
+	size_t idx;
+
+	for (idx = 0; idx < len; ++idx) {
+		const struct code_entry *entry = &code_table[state][in[idx]];
+
+		acc = (acc << entry->length) | entry->bits;
+		acc_bits += entry->length;
+		state = next_state_table[state][in[idx]];
+		if (acc_bits >= 32) {
+			acc_bits -= 32;
+			store_be32(out, (uint32_t)(acc >> acc_bits));
+			out += 4;
+			total += 32;
+		}
+	}
+
+	// Flush the remaining bits, left-aligned and zero padded
+	total += acc_bits;
+	if (acc_bits > 0) {
+		acc <<= 64 - acc_bits;
+	}
+	while (acc_bits > 0) {
+		*out++ = acc >> 56;
+		acc <<= BITS_IN_A_BYTE;
+		acc_bits = acc_bits > BITS_IN_A_BYTE ? acc_bits - BITS_IN_A_BYTE : 0;
+	}
+	return total;
+}
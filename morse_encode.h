@@ -0,0 +1,26 @@
+#ifndef MORSE_ENCODE_H
+#define MORSE_ENCODE_H
+
+// Userspace batch encoder: renders text into the keying bitstream the driver
+// would flash for a single write of the same text.
+//
+// The bitstream holds one bit per dot time, msb of each byte first, 1 for
+// LED on. Text is normalized exactly like the driver does: invalid
+// characters are dropped, runs containing a space become one word gap, and
+// leading and trailing spaces are trimmed.
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Longest run of bits a single input character can add to the stream.
+#define MORSE_ENCODE_MAX_CHAR_BITS 20
+
+// Number of bits morse_encode() produces for the text.
+size_t morse_encoded_bits(const char *text, size_t len);
+
+// Encodes the text into out, which must hold at least
+// (morse_encoded_bits() + 7) / 8 bytes. Bits after the end of the stream in
+// the last byte are 0. Returns the number of bits written.
+size_t morse_encode(const char *text, size_t len, uint8_t *out);
+
+#endif
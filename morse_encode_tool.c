@@ -0,0 +1,57 @@
+// morse-encode: renders stdin into the keying bitstream the driver would
+// flash for a single write of the same text, and writes it to stdout.
+// The number of bits is printed to stderr.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "morse_encode.h"
+
+#define READ_CHUNK (1 << 20)
+
+int main(void)
+{
+	char *text = NULL;
+	size_t len = 0;
+	size_t capacity = 0;
+	uint8_t *bitstream;
+	size_t bits;
+
+	for (;;) {
+		size_t bytes_read;
+
+		if (capacity - len < READ_CHUNK) {
+			capacity = capacity ? capacity * 2 : READ_CHUNK;
+			text = realloc(text, capacity);
+			if (!text) {
+				perror("morse-encode");
+				return EXIT_FAILURE;
+			}
+		}
+		bytes_read = fread(text + len, 1, capacity - len, stdin);
+		len += bytes_read;
+		if (bytes_read == 0) {
+			break;
+		}
+	}
+	if (ferror(stdin)) {
+		perror("morse-encode");
+		return EXIT_FAILURE;
+	}
+
+	bitstream = malloc((morse_encoded_bits(text, len) + 7) / 8 + 1);
+	if (!bitstream) {
+		perror("morse-encode");
+		return EXIT_FAILURE;
+	}
+	bits = morse_encode(text, len, bitstream);
+	if (fwrite(bitstream, 1, (bits + 7) / 8, stdout) != (bits + 7) / 8) {
+		perror("morse-encode");
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "%zu bits\n", bits);
+
+	free(bitstream);
+	free(text);
+	return EXIT_SUCCESS;
+}
@@ -3,15 +3,89 @@
 #include <linux/fs.h>
 #include <linux/leds.h>
 #include <linux/kfifo.h>
-#include <linux/delay.h>
+#include <linux/hrtimer.h>
+#include <linux/sched.h>
 #include <linux/mutex.h>
 #include <linux/types.h>
+#include <linux/percpu.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/ktime.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/kref.h>
+#include <linux/completion.h>
+#include <linux/wait.h>
+#include <linux/kthread.h>
+#include <linux/bitops.h>
+#include <linux/capability.h>
+#include <linux/workqueue.h>
+#include <linux/rcupdate.h>
+#include <linux/atomic.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/version.h>
+#include <linux/build_bug.h>
+#include <linux/poll.h>
+#include <linux/jump_label.h>
+#include <linux/kobject.h>
+#include <linux/memcontrol.h>
+#include <linux/sched/mm.h>
+#include <linux/hashtable.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/gpio.h>
+#include <linux/gpio/consumer.h>
+#include <linux/interrupt.h>
+#include <linux/input.h>
+#include <linux/netdevice.h>
+#include <linux/skbuff.h>
+#include <linux/if_arp.h>
+#include <linux/pm_qos.h>
+#include <linux/sort.h>
 #include <asm/uaccess.h>
 
-#define DEVICE_NAME  "morse-code"
+#include "morsecode.h"
+#include "morsecode_table.h"
+
+// The rest of the driver uses kernel APIs up to those of Linux 5.10
+// (set_active_memcg() being the newest); the features below need more.
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 10, 0)
+#error "morsecode needs Linux 5.10 or later"
+#endif
+
+// io_uring passthrough needs the cancelable uring_cmd interface of Linux
+// 6.7 and later.
+#if IS_ENABLED(CONFIG_IO_URING) && LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+#define MORSECODE_URING_CMD
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+#include <linux/io_uring/cmd.h>
+#else
+#include <linux/io_uring.h>
+#endif
+#endif
+
+// The BPF filter hook needs kfunc sets of Linux 6.9 and later, and BTF for
+// modules so that programs can attach to it.
+#if IS_ENABLED(CONFIG_BPF_SYSCALL) && IS_ENABLED(CONFIG_DEBUG_INFO_BTF_MODULES) && \
+    LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+#define MORSECODE_BPF_FILTER
+#include <linux/bpf.h>
+#include <linux/btf.h>
+#include <linux/btf_ids.h>
+#endif
 
-#define INTER_WORD_DOTTIMES 7
-#define INTER_LETTER_DOTTIMES 3
+// The line discipline is written against the tty_ldisc_ops of Linux 6.6.
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+#define MORSECODE_LDISC
+#include <linux/tty.h>
+#include <linux/tty_ldisc.h>
+#include <linux/tty_flip.h>
+#endif
+
+#define DEVICE_NAME  "morse-code"
 
 #define BITS_IN_A_BYTE 8
 #define ONES_IN_A_DOT 1
@@ -22,57 +96,81 @@
 
 #define QUEUE_SIZE (1 << 15)
 
-// Morse Encoding description:
-// - msb to be output first, followed by 2nd msb... (left to right)
-// - each bit gets one "dot" time.
-// - "dashes" are encoded here as being 3 times as long as "dots". Therefore
-//   a single dash will be the bits: 111.
-// - ignore trailing 0's (once last 1 output, rest of 0's ignored).
-// - Space between dashes and dots is one dot time, so is therefore encoded
-//   as a 0 bit between two 1 bits.
-//
-// Example:
-//   R = dot   dash   dot       -- Morse code
-//     =  1  0 111  0  1        -- 1=LED on, 0=LED off
-//     =  1011 101              -- Written together in groups of 4 bits.
-//     =  1011 1010 0000 0000   -- Pad with 0's on right to make 16 bits long.
-//     =  B    A    0    0      -- Convert to hex digits
-//     = 0xBA00                 -- Full hex value (see value in table below)
-//
-// Between characters, must have 3-dot times (total) of off (0's) (not encoded here)
-// Between words, must have 7-dot times (total) of off (0's) (not encoded here).
-static const unsigned short letter_to_morsecode_bits_map[] = {
-	0xB800,	// A 1011 1
-	0xEA80,	// B 1110 1010 1
-	0xEBA0,	// C 1110 1011 101
-	0xEA00,	// D 1110 101
-	0x8000,	// E 1
-	0xAE80,	// F 1010 1110 1
-	0xEE80,	// G 1110 1110 1
-	0xAA00,	// H 1010 101
-	0xA000,	// I 101
-	0xBBB8,	// J 1011 1011 1011 1
-	0xEB80,	// K 1110 1011 1
-	0xBA80,	// L 1011 1010 1
-	0xEE00,	// M 1110 111
-	0xE800,	// N 1110 1
-	0xEEE0,	// O 1110 1110 111
-	0xBBA0,	// P 1011 1011 101
-	0xEEB8,	// Q 1110 1110 1011 1
-	0xBA00,	// R 1011 101
-	0xA800,	// S 1010 1
-	0xE000,	// T 111
-	0xAE00,	// U 1010 111
-	0xAB80,	// V 1010 1011 1
-	0xBB80,	// W 1011 1011 1
-	0xEAE0,	// X 1110 1010 111
-	0xEBB8,	// Y 1110 1011 1011 1
-	0xEEA0	// Z 1110 1110 101
+// Messages are compiled into a timeline of runs before they are played.
+// Each run is one byte: the LED state and how many dot times it lasts.
+#define RUN_DOTS_MASK 0x0f
+#define RUN_ON 0x10             // LED on; otherwise off
+#define RUN_LETTER_END 0x20     // last dot or dash of a letter
+#define RUN_LETTER_GAP 0x40     // gap between letters of a word
+#define RUN_WORD_GAP 0x80       // gap standing for a space in the text
+// Most runs a single character of text can compile to.
+#define MAX_RUNS_PER_CHAR 8
+
+// Messages longer than this are split at word boundaries and compiled in
+// parallel, so playback can start before the whole message is compiled.
+#define COMPILE_CHUNK_SIZE (64 * 1024)
+
+// Channels beyond the first are /dev/morse-code1, /dev/morse-code2, ...
+#define MAX_CHANNELS 8
+
+// Members of a group start this long after the last of them is ready, so
+// every transmitter has woken up and is waiting on the same deadline.
+#define GROUP_START_LEAD_NS (1 * NSEC_PER_MSEC)
+
+// Echo buffer of each reader with a granularity coarser than symbols.
+#define READER_QUEUE_SIZE 4096
+
+// Latency records kept per channel for debugfs; older ones are overwritten.
+#define LATENCY_RECORDS 1024
+
+// A tty line longer than this is queued in pieces, split at a space.
+#define LDISC_LINE_SIZE 256
+// Lines a tty may have queued before its input is held back.
+#define LDISC_MAX_INFLIGHT 4
+
+// The net_device over a channel (see create_link()).
+#define NET_DEFAULT_MTU 1280
+#define NET_MAX_MTU 1500
+// Frames it may have queued on the channel before its queue is stopped.
+#define NET_MAX_INFLIGHT 8
+
+// Limits for submission rings set up with MORSECODE_IOC_RING_SETUP.
+#define MAX_RING_ENTRIES 4096
+#define MAX_RING_TEXT_SIZE (1 << 20)
+
+/******************************************************
+ * Statistics
+ ******************************************************/
+// Scheduling policies for the transmit queue (see pick_next_message()).
+enum {
+	SCHED_POLICY_FIFO,
+	SCHED_POLICY_SAF,       // shortest airtime first
+	NR_SCHED_POLICIES
+};
+
+static const char *const sched_policy_names[NR_SCHED_POLICIES] = {
+	"fifo",
+	"saf",
+};
+
+// Counters (struct morsecode_stats_snapshot in morsecode.h) are kept
+// per-CPU so that concurrent writers, readers and the playback path never
+// share a cacheline. They are only summed when the "stats" sysfs attribute
+// of the device is read or a snapshot is requested.
+// Every member must be a u64: stats_snapshot() sums them as an array.
+struct morsecode_stats {
+	struct morsecode_stats_snapshot counters;
+	struct u64_stats_sync syncp;
 };
 
-DEFINE_LED_TRIGGER(led_trigger);
-static DECLARE_KFIFO(flashed_codes_queue, char, QUEUE_SIZE);
-static DEFINE_MUTEX(queue_mutex);
+#define stats_add(ch, field, amount) \
+	do { \
+		struct morsecode_stats *stats = get_cpu_ptr((ch)->stats); \
+		u64_stats_update_begin(&stats->syncp); \
+		stats->counters.field += (amount); \
+		u64_stats_update_end(&stats->syncp); \
+		put_cpu_ptr((ch)->stats); \
+	} while (0)
 
 #define driver_print(logLevel, message, ...) printk(logLevel DEVICE_NAME ": " message, ##__VA_ARGS__)
 
@@ -91,101 +189,429 @@ module_param(dottime, int, S_IRUGO);
 MODULE_PARM_DESC(dottime, " Sets the timing of the morse code \"dot\", in ms."
                  " Range is 1 to 2000.");
 
+// Finer-grained alternative to dottime for fast optical receivers.
+#define MIN_DOT_TIME_US 20
+#define MAX_DOT_TIME_US (MAX_DOT_TIME * USEC_PER_MSEC)
+static unsigned int dottime_us;
+module_param(dottime_us, uint, S_IRUGO);
+MODULE_PARM_DESC(dottime_us, " Sets the timing of the morse code \"dot\", in us,"
+                 " overriding dottime. Range is 20 to 2000000; 0 uses dottime.");
+
+// Dot period actually used by the timing engine, set at load time.
+static u64 dot_ns;
+
+// Puts every channel's edges on one shared grid, so channels with edges at
+// about the same time are served by a single timer expiry.
+static unsigned int tick_grid_us;
+module_param(tick_grid_us, uint, S_IRUGO);
+MODULE_PARM_DESC(tick_grid_us, " Aligns all channels' edges to a shared grid of"
+                 " this period, in us. Must divide the dot time; 0 disables.");
+
+// Grid period actually used, or 0 when edges are not aligned.
+static u64 tick_grid_ns;
+
+static int sched_policy = SCHED_POLICY_FIFO;
+module_param(sched_policy, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(sched_policy, " Order in which queued messages are sent:"
+                 " 0 = first in first out, 1 = shortest airtime first.");
+
+#define DEFAULT_SAF_MAX_WAIT_MS 10000
+static unsigned int saf_max_wait_ms = DEFAULT_SAF_MAX_WAIT_MS;
+module_param(saf_max_wait_ms, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(saf_max_wait_ms, " With shortest airtime first, a message that"
+                 " has waited this long (in ms) is sent next regardless of length.");
+
+static bool lazy_echo = true;
+module_param(lazy_echo, bool, S_IRUGO);
+MODULE_PARM_DESC(lazy_echo, " Only produce the symbol echo while a file is open"
+                 " for reading it. 0 always buffers it, as older versions did.");
+
+// Per-cgroup caps on what may be queued at once, across all channels.
+// Messages count until they are done; 0 means no cap.
+static unsigned int cgroup_max_airtime_ms;
+module_param(cgroup_max_airtime_ms, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(cgroup_max_airtime_ms, " Most airtime (in ms) the messages of one"
+                 " memory cgroup may have queued; further submissions fail with EDQUOT.");
+
+static unsigned int cgroup_max_bytes;
+module_param(cgroup_max_bytes, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(cgroup_max_bytes, " Most normalized text (in bytes) the messages of"
+                 " one memory cgroup may have queued; further submissions fail with EDQUOT.");
+
+// Straight-key input, decoded into /dev/morse-rx (see create_receiver()).
+static int key_gpio = -1;
+module_param(key_gpio, int, S_IRUGO);
+MODULE_PARM_DESC(key_gpio, " GPIO number of a straight key to decode; -1 for none.");
+
+static bool key_active_low = true;
+module_param(key_active_low, bool, S_IRUGO);
+MODULE_PARM_DESC(key_active_low, " The key on key_gpio pulls the line low when pressed.");
+
+static unsigned int key_code;
+module_param(key_code, uint, S_IRUGO);
+MODULE_PARM_DESC(key_code, " Input event key code (e.g. 57 for space) to decode"
+                 " from any input device that has it; 0 for none.");
+
+static bool cpu_latency_qos = true;
+module_param(cpu_latency_qos, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(cpu_latency_qos, " Keep deep CPU idle states off while a channel"
+                 " transmits, so their exit latency does not land on the edges.");
+
+static unsigned int cpu_latency_us;
+module_param(cpu_latency_us, uint, S_IRUGO);
+MODULE_PARM_DESC(cpu_latency_us, " CPU wakeup latency (in us) to ask for while"
+                 " transmitting; 0 for a tenth of the dot time. At most one dot time.");
+
+static int tty_ldisc = -1;
+module_param(tty_ldisc, int, S_IRUGO);
+MODULE_PARM_DESC(tty_ldisc, " Line discipline number to register, e.g. 29"
+                 " (N_DEVELOPMENT); -1 for none.");
+
+static int net_channel = -1;
+module_param(net_channel, int, S_IRUGO);
+MODULE_PARM_DESC(net_channel, " Channel to also expose as the point-to-point network"
+                 " device morse0; -1 for none.");
+
+static unsigned int channels = 1;
+module_param(channels, uint, S_IRUGO);
+MODULE_PARM_DESC(channels, " Number of independent channels, each with its own"
+                 " device, LED trigger and transmitter. Range is 1 to 8.");
+
+/******************************************************
+ * Channels
+ ******************************************************/
+// One line of <debugfs>/morse-code/<channel>/latency, for a finished
+// message. Times are CLOCK_MONOTONIC ns, or 0 for stages it never reached.
+struct morse_latency_record {
+	u64 id;
+	s64 enqueued_ns;
+	s64 encode_start_ns;
+	s64 encode_end_ns;          // last chunk it played was compiled
+	s64 first_edge_ns;          // first LED change it made
+	s64 last_edge_ns;
+	s64 completed_ns;
+	int status;                 // 0 or a negative errno
+	u32 channel;
+};
+
+// A channel is one device node and LED trigger with its own transmitter,
+// queue, echo backlog and statistics. Channel 0 keeps the original names.
+struct morse_channel {
+	int index;
+	char name[16];                      // device and LED trigger name
+	struct miscdevice misc;
+	struct led_trigger *led_trigger;
+	enum led_brightness led_state;      // last state sent to the trigger
+	ktime_t last_edge;                  // when led_state last changed
+	u32 edge_comp_on_ns;                // how early on edges are issued
+	u32 edge_comp_off_ns;               // how early off edges are issued
+	u32 tags;                           // matched against file affinities
+	struct kfifo flashed_codes_queue;
+	struct mutex queue_mutex;
+	// Protected by queue_mutex:
+	ktime_t echo_first_unread;          // when the oldest buffered echo came
+	struct list_head echo_readers;      // symbol readers with watermarks set
+	struct list_head coarse_readers;    // readers with a private echo buffer
+	unsigned int echo_wake_len;         // lowest low_wm among them
+	u64 echo_min_latency_ns;            // lowest max latency among them
+	wait_queue_head_t echo_wait;
+	struct hrtimer echo_timer;          // wakes readers at the latency bound
+	atomic_t symbol_readers;            // open files reading the symbol echo
+	// Wakeups by echo_timer, which runs in hard irq context and so cannot
+	// use the per-CPU counters; added to reader_wakeups in snapshots.
+	atomic64_t timer_reader_wakeups;
+	struct morsecode_stats __percpu *stats;
+
+	struct list_head tx_queue;
+	struct list_head group_queue;       // group members, in commit order
+	spinlock_t tx_lock;
+	wait_queue_head_t tx_wait;
+	wait_queue_head_t tx_idle_wait;
+	struct task_struct *tx_task;
+	ktime_t tx_deadline;                // next LED edge
+	struct pm_qos_request cpu_latency_req;  // active while transmitting
+	// Protected by tx_lock:
+	unsigned int tx_urgent_queued;
+	struct morse_msg *tx_preempted;     // resumes once no urgent message waits
+	struct morse_msg *tx_active;        // being flashed right now
+	bool tx_handed_off;                 // state exported; transmitter parked
+	bool tx_paused;                     // parked for calibration; queue still open
+	u64 backlog_dots;                   // airtime of queued and parked messages
+	bool backlog_high;                  // above backlog_high_ms, not yet below low
+	bool wait_slo_exceeded;             // last started message waited too long
+	u64 slo_wait_ns;                    // that message's wait
+
+	// Orchestration events (see post_event()), off when the thresholds are 0.
+	unsigned int backlog_high_ms;
+	unsigned int backlog_low_ms;
+	unsigned int wait_slo_ms;
+	unsigned long pending_events;
+	struct work_struct event_work;
+
+	// Serializes state export and import.
+	struct mutex state_mutex;
+
+	struct mutex ring_mutex;            // protects polled_rings
+	struct list_head polled_rings;      // drained by the transmitter
+
+	// The last LATENCY_RECORDS finished messages, oldest at latency_next
+	// once the ring has wrapped.
+	spinlock_t latency_lock;
+	struct morse_latency_record *latency_records;
+	u64 latency_next;                   // records written so far
+	struct dentry *debugfs;
+};
+
+static struct morse_channel *morse_channels[MAX_CHANNELS];
+
+// Uevents sent from the channel's device as MORSECODE_EVENT=<name>.
+enum {
+	CHANNEL_EVENT_BACKLOG_HIGH,
+	CHANNEL_EVENT_BACKLOG_LOW,
+	CHANNEL_EVENT_WAIT_SLO,
+	NR_CHANNEL_EVENTS
+};
+
+static const char *const channel_event_names[NR_CHANNEL_EVENTS] = {
+	"backlog_high",
+	"backlog_low",
+	"wait_slo",
+};
+
+// On while any channel needs its symbol echo (see echo_wanted()), so the
+// transmitter skips the echo path entirely when nobody reads it.
+static DEFINE_STATIC_KEY_FALSE(symbol_echo_key);
+
+static void stats_snapshot(struct morse_channel *ch,
+                           struct morsecode_stats_snapshot *total)
+{
+	int cpu;
+
+	memset(total, 0, sizeof(*total));
+	for_each_possible_cpu(cpu) {
+		const struct morsecode_stats *stats = per_cpu_ptr(ch->stats, cpu);
+		struct morsecode_stats_snapshot snapshot;
+		const u64 *src = (const u64 *)&snapshot;
+		u64 *dst = (u64 *)total;
+		unsigned int start;
+		int idx;
+
+		do {
+			start = u64_stats_fetch_begin(&stats->syncp);
+			snapshot = stats->counters;
+		} while (u64_stats_fetch_retry(&stats->syncp, start));
+
+		for (idx = 0; idx < sizeof(snapshot) / sizeof(u64); ++idx) {
+			dst[idx] += src[idx];
+		}
+	}
+	total->reader_wakeups += atomic64_read(&ch->timer_reader_wakeups);
+}
+
 /******************************************************
  * Helper and Processing Functions
  ******************************************************/
 
-static int queue_lock(void)
+static int queue_lock(struct morse_channel *ch)
 {
-	return mutex_lock_interruptible(&queue_mutex);
+	return mutex_lock_interruptible(&ch->queue_mutex);
 }
 
-static void queue_unlock(void)
+static void queue_unlock(struct morse_channel *ch)
 {
-	mutex_unlock(&queue_mutex);
+	mutex_unlock(&ch->queue_mutex);
 }
 
-static int put_valid_morsecode_into_queue(const int consecutive_ones_seen)
+static void put_symbol_into_queue(struct morse_channel *ch, char symbol)
 {
-	if ((consecutive_ones_seen == ONES_IN_A_DOT) ||
-	        (consecutive_ones_seen == ONES_IN_A_DASH)) {
-		if (queue_lock()) {
-			return -EFAULT;
-		}
-		if (consecutive_ones_seen == ONES_IN_A_DOT) {
-			kfifo_put(&flashed_codes_queue, DOT_SYMBOL);
-		} else if (consecutive_ones_seen == ONES_IN_A_DASH) {
-			kfifo_put(&flashed_codes_queue, DASH_SYMBOL);
-		}
-		queue_unlock();
+	if (!kfifo_put(&ch->flashed_codes_queue, symbol)) {
+		stats_add(ch, drops, 1);
 	}
-	return 0;
 }
 
-static int flash_morsecode(unsigned short morsecode)
+// Rounds up to the next point on the shared tick grid. The grid divides the
+// dot time, so a timeline that starts on it keeps every edge on it.
+static ktime_t snap_to_grid(ktime_t t)
 {
-	int consecutive_ones_seen = 0;
-	// iterate through each bit in bitstring, from left to right
-	while (morsecode != 0) {
-		unsigned char leftmost_bit =
-		    (morsecode >> (sizeof(unsigned short) * BITS_IN_A_BYTE - 1));
+	u64 rem;
 
-		if (leftmost_bit == 1) {
-			led_trigger_event(led_trigger, LED_FULL);
-			consecutive_ones_seen++;
-		} else {
-			if (put_valid_morsecode_into_queue(consecutive_ones_seen)) {
-				return -EFAULT;
-			}
-			led_trigger_event(led_trigger, LED_OFF);
-			consecutive_ones_seen = 0;
-		}
-		msleep(dottime);
-		morsecode <<= 1;
+	if (!tick_grid_ns) {
+		return t;
+	}
+	div64_u64_rem(ktime_to_ns(t), tick_grid_ns, &rem);
+	return rem ? ktime_add_ns(t, tick_grid_ns - rem) : t;
+}
+
+// The transmitter keeps an absolute deadline for the next LED edge and
+// advances it by whole dot times, so sleep overshoot on one edge never
+// accumulates into the timing of the following ones.
+static void start_timeline(struct morse_channel *ch)
+{
+	ktime_t now = ktime_get();
+
+	if (ktime_before(ch->tx_deadline, now)) {
+		ch->tx_deadline = snap_to_grid(now);
+	}
+}
+
+// The LEDs take a while to follow each edge, and longer for one direction
+// than the other. Edges are issued early by the channel's compensation for
+// their direction. On a tick grid it is rounded to whole grid periods, so
+// that early wakeups still land on the grid.
+static u64 edge_comp_ns(struct morse_channel *ch, enum led_brightness brightness)
+{
+	u64 comp_ns = brightness == LED_OFF ? READ_ONCE(ch->edge_comp_off_ns) :
+	                                      READ_ONCE(ch->edge_comp_on_ns);
+
+	if (!tick_grid_ns) {
+		return comp_ns;
+	}
+	return div64_u64(comp_ns + tick_grid_ns / 2, tick_grid_ns) * tick_grid_ns;
+}
+
+// The transmitter wakes early enough for either direction.
+static u64 edge_lead_ns(struct morse_channel *ch)
+{
+	return max(edge_comp_ns(ch, LED_FULL), edge_comp_ns(ch, LED_OFF));
+}
+
+// Sleeps until lead_ns before the deadline.
+static void sleep_until_deadline(struct morse_channel *ch, u64 lead_ns)
+{
+	ktime_t wake = ktime_sub_ns(ch->tx_deadline, lead_ns);
+
+	set_current_state(TASK_UNINTERRUPTIBLE);
+	schedule_hrtimeout_range(&wake, 0, HRTIMER_MODE_ABS);
+}
+
+// While a channel transmits, the exit latency of deep idle states would be
+// added to every edge it times. The request keeps those states off from the
+// first message until the channel next runs out of work.
+static void hold_cpu_latency(struct morse_channel *ch)
+{
+	u64 latency_us = cpu_latency_us ? cpu_latency_us : div_u64(dot_ns, 10 * NSEC_PER_USEC);
+
+	if (!READ_ONCE(cpu_latency_qos) || cpu_latency_qos_request_active(&ch->cpu_latency_req)) {
+		return;
+	}
+	latency_us = min_t(u64, latency_us, div_u64(dot_ns, NSEC_PER_USEC));
+	cpu_latency_qos_add_request(&ch->cpu_latency_req, latency_us);
+}
+
+static void release_cpu_latency(struct morse_channel *ch)
+{
+	if (cpu_latency_qos_request_active(&ch->cpu_latency_req)) {
+		cpu_latency_qos_remove_request(&ch->cpu_latency_req);
+	}
+}
+
+static void wait_dottimes(struct morse_channel *ch, unsigned int dots)
+{
+	u64 lead_ns = edge_lead_ns(ch);
+
+	ch->tx_deadline = ktime_add_ns(ch->tx_deadline, (u64)dots * dot_ns);
+	sleep_until_deadline(ch, lead_ns);
+	stats_add(ch, timer_wakeups, 1);
+	stats_add(ch, timer_late_ns,
+	          max_t(s64, 0, ktime_to_ns(ktime_sub(ktime_get(),
+	                                              ktime_sub_ns(ch->tx_deadline, lead_ns)))));
+}
+
+static bool echo_wanted(struct morse_channel *ch)
+{
+	if (!static_branch_unlikely(&symbol_echo_key)) {
+		return false;
+	}
+	return !lazy_echo || atomic_read(&ch->symbol_readers) > 0;
+}
+
+// Readers with watermarks are woken only when the echo reaches the lowest
+// low_wm among them, or by echo_timer once the oldest unread echo has
+// waited the lowest max latency, not for every symbol.
+static int echo_symbols(struct morse_channel *ch, char symbol, int count)
+{
+	bool was_empty;
+
+	if (!echo_wanted(ch)) {
+		return 0;
 	}
-	if (put_valid_morsecode_into_queue(consecutive_ones_seen)) {
+	if (queue_lock(ch)) {
 		return -EFAULT;
 	}
-	led_trigger_event(led_trigger, LED_OFF);
-	msleep(dottime);
+	was_empty = kfifo_is_empty(&ch->flashed_codes_queue);
+	while (count--) {
+		put_symbol_into_queue(ch, symbol);
+	}
+	if (was_empty) {
+		ch->echo_first_unread = ktime_get();
+		if (ch->echo_min_latency_ns) {
+			hrtimer_start(&ch->echo_timer, ns_to_ktime(ch->echo_min_latency_ns),
+			              HRTIMER_MODE_REL);
+		}
+	}
+	if (!list_empty(&ch->echo_readers) &&
+	        kfifo_len(&ch->flashed_codes_queue) >= ch->echo_wake_len &&
+	        wq_has_sleeper(&ch->echo_wait)) {
+		wake_up_interruptible(&ch->echo_wait);
+		stats_add(ch, reader_wakeups, 1);
+	}
+	queue_unlock(ch);
 	return 0;
 }
 
-static int process_morsecode(char ch, bool is_not_first_char)
+// Every LED bound to the channel's trigger mirrors the channel: each edge
+// is a single led_trigger_event() call, which updates all of them in one
+// pass from the one transmitter thread and timer. Runs that do not change
+// the LED state write nothing.
+static void set_leds(struct morse_channel *ch, enum led_brightness brightness)
+{
+	u64 lead_ns;
+
+	if (brightness == ch->led_state) {
+		return;
+	}
+	// The transmitter woke for the earlier of the two directions
+	lead_ns = edge_comp_ns(ch, brightness);
+	if (lead_ns < edge_lead_ns(ch)) {
+		sleep_until_deadline(ch, lead_ns);
+	}
+	led_trigger_event(ch->led_trigger, brightness);
+	ch->led_state = brightness;
+	ch->last_edge = ktime_get();
+	stats_add(ch, edges, 1);
+}
+
+// Plays one run of a timeline and echoes what it stands for: a dot or dash
+// when an on run ends, one separator between letters and three between
+// words.
+static int play_run(struct morse_channel *ch, u8 run)
 {
-	int letter_idx = 0;
-	unsigned short morsecode_bits;
+	unsigned int dots = run & RUN_DOTS_MASK;
 
-	if ('a' <= ch && ch <= 'z') {
-		letter_idx = ch - 'a';
-	} else if ('A' <= ch && ch <= 'Z') {
-		letter_idx = ch - 'A';
-	} else if (ch == ' ') {
-		if (queue_lock()) {
+	if (run & RUN_ON) {
+		set_leds(ch, LED_FULL);
+		wait_dottimes(ch, dots);
+		if (echo_symbols(ch, dots == ONES_IN_A_DOT ? DOT_SYMBOL : DASH_SYMBOL, 1)) {
 			return -EFAULT;
 		}
-		kfifo_put(&flashed_codes_queue, SEPARATOR_SYMBOL);
-		kfifo_put(&flashed_codes_queue, SEPARATOR_SYMBOL);
-		queue_unlock();
-		msleep((INTER_WORD_DOTTIMES - INTER_LETTER_DOTTIMES) * dottime);
-		return 0;
-	} else { // if invalid character
+		stats_add(ch, symbols, 1);
+		if (run & RUN_LETTER_END) {
+			stats_add(ch, characters, 1);
+		}
 		return 0;
 	}
 
-	if (is_not_first_char) {
-		if (queue_lock()) {
+	set_leds(ch, LED_OFF);
+	if (run & RUN_LETTER_GAP) {
+		if (echo_symbols(ch, SEPARATOR_SYMBOL, 1)) {
+			return -EFAULT;
+		}
+	} else if (run & RUN_WORD_GAP) {
+		if (echo_symbols(ch, SEPARATOR_SYMBOL, 3)) {
 			return -EFAULT;
 		}
-		kfifo_put(&flashed_codes_queue, SEPARATOR_SYMBOL);
-		queue_unlock();
-		msleep((INTER_LETTER_DOTTIMES - 1) * dottime);
-	}
-
-	morsecode_bits = letter_to_morsecode_bits_map[letter_idx];
-	if (flash_morsecode(morsecode_bits)) {
-		return -EFAULT;
 	}
+	wait_dottimes(ch, dots);
 	return 0;
 }
 
@@ -194,139 +620,4274 @@ static bool is_letter(char ch)
 	return ('a' <= ch && ch <= 'z') || ('A' <= ch && ch <= 'Z');
 }
 
-static bool is_morsecode_char(char ch)
+/******************************************************
+ * Message Queue and Transmitter
+ ******************************************************/
+// Writers turn their buffer into a message and queue it; each channel's
+// transmitter thread owns its LEDs and plays messages one at a time in the
+// order chosen by sched_policy. The writer sleeps until its message is done.
+struct morse_msg {
+	struct list_head node;  // on tx_queue or group_queue while waiting
+	struct kref ref;        // held by the writer and by the queue
+	struct completion done;
+	struct morse_channel *channel;
+	char *text;             // letters separated by single spaces
+	size_t len;
+	size_t pos;             // next character to flash
+	u64 airtime;            // in dot times
+	bool urgent;
+	ktime_t enqueued;
+	ktime_t started;
+	int policy;             // policy in force when the message was picked
+	int status;
+	struct list_head chunks;    // compiled timeline, in playback order
+	size_t run;                 // next run to play in the first chunk
+	struct morse_group *group;  // group it starts with, if any
+	bool group_arrived;         // counted towards the group's start
+	s64 skew_ns;                // first edge relative to the group's start
+	struct morse_ring *ring;    // submission ring it came from, if any
+	struct morse_ldisc *ldisc;  // tty it came from, if any
+	struct morse_link *link;    // net device it carries a frame for, if any
+	unsigned int frame_len;     // bytes in that frame
+	unsigned int tail_dots;     // off time after the last letter
+	ktime_t encode_start;       // compile_message() began
+	ktime_t encode_end;         // last played chunk was compiled
+	ktime_t first_edge;
+	ktime_t last_edge;
+	u64 id;                     // unique, for MORSECODE_IOC_CANCEL
+	u64 owner;                  // id of the submitting file, or 0
+	struct io_uring_cmd *uring_cmd; // completed when the message is done
+	struct mem_cgroup *memcg;   // submitter's, charged for its memory
+	struct morse_quota *quota;  // counted against its cgroup's caps, if any
+};
+
+// What the messages of one memory cgroup have queued, while caps are set.
+struct morse_quota {
+	struct hlist_node node;     // in quotas, keyed by memcg
+	struct mem_cgroup *memcg;   // pinned by its messages, not by the quota
+	u64 airtime;                // in dot times
+	u64 bytes;
+	unsigned int nr_messages;
+};
+
+// Messages submitted together on several channels. Each transmitter counts
+// in when it reaches its member; the last one fixes a shared start time a
+// little in the future, and all of them sleep until that same deadline.
+struct morse_group {
+	struct kref ref;            // held by the submitter and each member
+	atomic_t arrivals_pending;  // members whose transmitter is not ready yet
+	wait_queue_head_t wait;
+	ktime_t start;
+	bool released;              // start is set
+	bool aborted;               // submitter gave up; unstarted members fail
+};
+
+// A compiled piece of a message covering text[start, end). Every chunk after
+// the first starts on a space, i.e. with a word gap.
+struct morse_chunk {
+	struct list_head node;      // on the message's chunks
+	struct work_struct work;
+	struct completion ready;
+	struct morse_msg *msg;
+	size_t start;
+	size_t end;
+	u8 *runs;
+	size_t nr_runs;
+	ktime_t compiled;
+};
+
+// A submission ring shared with a producer through mmap() (see
+// MORSECODE_IOC_RING_SETUP). Only the text copied out of it is trusted:
+// userspace may rewrite the mapping at any time.
+struct morse_ring {
+	struct kref ref;            // held by the file and each queued message
+	struct mutex lock;          // serializes consumers
+	struct list_head node;      // on the channel's polled_rings
+	struct morse_channel *channel;
+	void *mem;                  // the mapping, from vmalloc_user()
+	size_t size;
+	struct morsecode_ring_entry *sq;
+	const char *text;
+	u32 entries;
+	u32 text_size;
+	u32 head;                   // kernel copy; hdr->head is only a mirror
+	u32 rejected;
+	atomic_t completed;
+	bool polled;
+	u64 owner;                  // id of the file that set it up
+	struct mem_cgroup *memcg;   // of the task that set it up
+};
+
+// A tty with the line discipline attached. Text it receives is buffered
+// here and queued a line at a time.
+struct morse_ldisc {
+	struct kref ref;            // held by the tty and each queued message
+	spinlock_t lock;            // protects port and throttled
+	struct tty_port *port;      // NULL once the discipline is closed
+	bool throttled;             // input held back until a line finishes
+	struct morse_channel *channel;
+	struct mem_cgroup *memcg;   // of the task that attached it
+	u64 id;                     // owner of the messages it queues
+	atomic_t inflight;          // its lines not done yet
+	size_t len;
+	char line[LDISC_LINE_SIZE];
+};
+
+// A channel exposed as a point-to-point net_device. Each frame goes out as
+// one message, a letter per nibble, followed by a word gap; frames are
+// received from the straight-key decoder the same way.
+struct morse_link {
+	struct kref ref;            // held by the device and each queued frame
+	spinlock_t lock;            // irq-safe; protects all below
+	struct net_device *dev;     // NULL once the device is gone
+	unsigned int inflight;      // frames not done yet
+	u8 rx_frame[NET_MAX_MTU];
+	unsigned int rx_len;
+	int rx_nibble;              // high nibble waiting for its low one, or -1
+	bool rx_bad;                // frame got something other than A to P
+	struct morse_channel *channel;
+	struct sk_buff_head tx_frames;  // waiting to be turned into messages
+	struct work_struct tx_work;
+	struct sk_buff_head rx_frames;  // decoded, waiting to go up the stack
+	struct work_struct rx_work;
+};
+
+// State kept for each open file.
+struct morse_file {
+	struct morse_channel *channel;
+	int priority;
+	struct morse_ring *ring;
+	u64 id;                     // owner of the messages it submits
+	struct list_head echo_node; // on the channel's echo_readers
+	unsigned int low_wm;        // 0 if no watermark is set
+	u64 max_latency_ns;
+	// Protected by the channel's queue_mutex:
+	int echo_granularity;
+	fmode_t file_mode;
+	bool symbol_reader;             // counted in the channel's symbol_readers
+	struct list_head coarse_node;   // on the channel's coarse_readers
+	struct kfifo echo_fifo;         // private echo of coarse readers
+	ktime_t echo_first_unread;
+	wait_queue_head_t echo_wait;
+};
+
+// Source of message and file ids; 0 is never handed out.
+static atomic64_t morse_ids = ATOMIC64_INIT(0);
+
+static struct workqueue_struct *compile_wq;
+
+// Serializes group submission, so that groups sharing channels are queued
+// in the same order on every one of them.
+static DEFINE_MUTEX(group_mutex);
+
+static DEFINE_HASHTABLE(quotas, 6);
+static DEFINE_SPINLOCK(quota_lock);
+
+// Number of dot times a letter takes, including one off dot after it.
+static unsigned int letter_dottimes(unsigned short morsecode_bits)
 {
-	return is_letter(ch) || (ch == ' ');
+	return sizeof(unsigned short) * BITS_IN_A_BYTE - __ffs(morsecode_bits) + 1;
 }
 
-/******************************************************
- * File Operation Callbacks
- ******************************************************/
+static int letter_index(char ch)
+{
+	return ('a' <= ch && ch <= 'z') ? ch - 'a' : ch - 'A';
+}
 
-static ssize_t my_read(struct file *file,
-                       char *buf, size_t count, loff_t *ppos)
+// Exact airtime of a normalized message, mirroring compile_chunk().
+static u64 message_airtime(const char *text, size_t len)
 {
-	unsigned int bytes_copied = 0;
+	u64 dots = 0;
+	size_t idx;
 
-	if (queue_lock()) {
-		return -EFAULT;
-	}
-	if (!kfifo_is_empty(&flashed_codes_queue)) {
-		kfifo_put(&flashed_codes_queue, '\n');
+	for (idx = 0; idx < len; ++idx) {
+		if (text[idx] == SEPARATOR_SYMBOL) {
+			dots += INTER_WORD_DOTTIMES - INTER_LETTER_DOTTIMES;
+			continue;
+		}
+		if (idx > 0) {
+			dots += INTER_LETTER_DOTTIMES - 1;
+		}
+		dots += letter_dottimes(letter_to_morsecode_bits_map[letter_index(text[idx])]);
 	}
-	if (kfifo_to_user(&flashed_codes_queue, buf, count, &bytes_copied)) {
-		queue_unlock();
-		return -EFAULT;
+	return dots;
+}
+
+// Trims leading and trailing spaces and invalid characters, and collapses
+// any run of them containing a space into a single space. Works in place and
+// returns the new length.
+static size_t normalize_message(char *text, size_t len)
+{
+	size_t in_idx;
+	size_t out_idx = 0;
+	bool pending_space = false;
+
+	for (in_idx = 0; in_idx < len; ++in_idx) {
+		char ch = text[in_idx];
+
+		if (is_letter(ch)) {
+			if (pending_space && out_idx > 0) {
+				text[out_idx++] = SEPARATOR_SYMBOL;
+			}
+			pending_space = false;
+			text[out_idx++] = ch;
+		} else if (ch == ' ') {
+			pending_space = true;
+		}
 	}
-	queue_unlock();
+	return out_idx;
+}
 
-	*ppos += bytes_copied;
-	return bytes_copied;
+// Appends the runs for one letter, bit by bit from the left, without the
+// off time that follows it. Returns the number of runs.
+static size_t compile_letter(u8 *runs, unsigned short morsecode)
+{
+	size_t nr_runs = 0;
+	unsigned int consecutive_ones_seen = 0;
+	unsigned int consecutive_zeros_seen = 0;
+
+	while (morsecode != 0) {
+		unsigned char leftmost_bit =
+		    (morsecode >> (sizeof(unsigned short) * BITS_IN_A_BYTE - 1));
+
+		if (leftmost_bit == 1) {
+			if (consecutive_zeros_seen) {
+				runs[nr_runs++] = consecutive_zeros_seen;
+				consecutive_zeros_seen = 0;
+			}
+			consecutive_ones_seen++;
+		} else {
+			if (consecutive_ones_seen) {
+				runs[nr_runs++] = RUN_ON | consecutive_ones_seen;
+				consecutive_ones_seen = 0;
+			}
+			consecutive_zeros_seen++;
+		}
+		morsecode <<= 1;
+	}
+	runs[nr_runs++] = RUN_ON | RUN_LETTER_END | consecutive_ones_seen;
+	return nr_runs;
 }
 
-static ssize_t my_write(struct file *file,
-                        const char *buff, size_t count, loff_t *ppos)
+// Compiles text[start, end) of a normalized message. A chunk that does not
+// begin the message starts with the gap in front of its first character;
+// only the end of the message gets the trailing off dot.
+static void compile_chunk(struct morse_chunk *chunk)
 {
-	int buff_idx;
-	char ch;
-	bool has_processed_first_char = false;
+	const struct morse_msg *msg = chunk->msg;
+	const char *text = msg->text;
+	size_t idx = chunk->start;
+	size_t nr_runs = 0;
 
-	// Trim leading spaces and invalid characters
-	for (buff_idx = 0; buff_idx < count; ++buff_idx) {
-		if (copy_from_user(&ch, &buff[buff_idx], sizeof(ch))) {
-			return -EFAULT;
+	if (idx > 0) {
+		if (text[idx] == SEPARATOR_SYMBOL) {
+			chunk->runs[nr_runs++] = RUN_WORD_GAP | INTER_WORD_DOTTIMES;
+			idx++;
+		} else {
+			chunk->runs[nr_runs++] = RUN_LETTER_GAP | INTER_LETTER_DOTTIMES;
 		}
-		if (ch != ' ' && is_letter(ch)) {
-			break;
+	}
+	for (; idx < chunk->end; ++idx) {
+		nr_runs += compile_letter(chunk->runs + nr_runs,
+		                          letter_to_morsecode_bits_map[letter_index(text[idx])]);
+		if (idx + 1 == msg->len) {
+			chunk->runs[nr_runs++] = msg->tail_dots;
+		} else if (idx + 1 < chunk->end) {
+			if (text[idx + 1] == SEPARATOR_SYMBOL) {
+				chunk->runs[nr_runs++] = RUN_WORD_GAP | INTER_WORD_DOTTIMES;
+				idx++;
+			} else {
+				chunk->runs[nr_runs++] = RUN_LETTER_GAP | INTER_LETTER_DOTTIMES;
+			}
 		}
 	}
+	chunk->nr_runs = nr_runs;
+	chunk->compiled = ktime_get();
+}
 
-	while (buff_idx < count) {
-		if (copy_from_user(&ch, &buff[buff_idx], sizeof(ch))) {
-			return -EFAULT;
+static void compile_chunk_work(struct work_struct *work)
+{
+	struct morse_chunk *chunk = container_of(work, struct morse_chunk, work);
+
+	compile_chunk(chunk);
+	complete_all(&chunk->ready);
+}
+
+static void free_chunk(struct morse_chunk *chunk)
+{
+	// A worker may still be compiling into it
+	wait_for_completion(&chunk->ready);
+	list_del(&chunk->node);
+	kvfree(chunk->runs);
+	kfree(chunk);
+}
+
+// Builds the timeline for the message from msg->pos onwards. Short messages
+// are compiled right away; longer ones are split at word boundaries and
+// compiled on compile_wq, with playback waiting on each chunk in turn.
+static int compile_message(struct morse_msg *msg)
+{
+	size_t start = msg->pos;
+	bool parallel = msg->len - msg->pos > COMPILE_CHUNK_SIZE;
+
+	msg->encode_start = ktime_get();
+	while (start < msg->len) {
+		struct morse_chunk *chunk = kzalloc(sizeof(*chunk), GFP_KERNEL_ACCOUNT);
+		size_t end = min_t(size_t, start + COMPILE_CHUNK_SIZE, msg->len);
+
+		if (!chunk) {
+			return -ENOMEM;
 		}
-		if (ch == ' ') {
-			int peek_buff_idx = buff_idx;
-			char peek_ahead_ch;
-			// Forward buffer index to character after spaces/invalid characters
-			while (++peek_buff_idx < count) {
-				if (copy_from_user(&peek_ahead_ch,
-				                   &buff[peek_buff_idx],
-				                   sizeof(peek_ahead_ch))) {
-					return -EFAULT;
-				}
-				if (peek_ahead_ch != ' ' && is_letter(peek_ahead_ch)) {
-					break;
-				}
-			}
-			// Found spaces/invalid characters at end of string
-			if (peek_buff_idx >= count) {
-				break;
-			}
-			buff_idx = peek_buff_idx - 1; // set index to last space
+		while (end < msg->len && msg->text[end] != SEPARATOR_SYMBOL) {
+			end++;
 		}
-		if (is_morsecode_char(ch)) {
-			if (process_morsecode(ch, has_processed_first_char)) {
-				return -EFAULT;
-			}
-			has_processed_first_char = true;
+		chunk->runs = kvmalloc_array(end - start + 1, MAX_RUNS_PER_CHAR,
+		                             GFP_KERNEL_ACCOUNT);
+		if (!chunk->runs) {
+			kfree(chunk);
+			return -ENOMEM;
+		}
+		chunk->msg = msg;
+		chunk->start = start;
+		chunk->end = end;
+		init_completion(&chunk->ready);
+		INIT_WORK(&chunk->work, compile_chunk_work);
+		list_add_tail(&chunk->node, &msg->chunks);
+		if (parallel) {
+			queue_work(compile_wq, &chunk->work);
+		} else {
+			compile_chunk(chunk);
+			complete_all(&chunk->ready);
 		}
-		buff_idx++;
+		start = end;
 	}
-	*ppos += count;
-	return count;
+	msg->run = 0;
+	return 0;
 }
 
-/******************************************************
- * Misc support
- ******************************************************/
-// Callbacks:  (structure defined in /linux/fs.h)
-struct file_operations my_fops = {
-	.owner    =  THIS_MODULE,
-	.read     =  my_read,
-	.write    =  my_write,
-};
+static void release_group(struct kref *ref)
+{
+	kfree(container_of(ref, struct morse_group, ref));
+}
 
-// Character Device info for the Kernel:
-static struct miscdevice my_miscdevice = {
-	.minor    = MISC_DYNAMIC_MINOR,         // Let the system assign one.
-	.name     = DEVICE_NAME,                // /dev/.... file.
-	.fops     = &my_fops                    // Callback functions.
-};
+static void put_group(struct morse_group *group)
+{
+	kref_put(&group->ref, release_group);
+}
 
-/******************************************************
- * Driver initialization and exit:
- ******************************************************/
-static int __init my_init(void)
+static void release_ring(struct kref *ref)
 {
-	int returnVal;
+	struct morse_ring *ring = container_of(ref, struct morse_ring, ref);
 
-	driver_print(KERN_INFO, "Driver initialized.\n");
-	INIT_KFIFO(flashed_codes_queue);
+	vfree(ring->mem);
+	mem_cgroup_put(ring->memcg);
+	kfree(ring);
+}
 
-	// Validate dottime
-	if (dottime < MIN_DOT_TIME || dottime > MAX_DOT_TIME) {
-		dottime = DEFAULT_DOT_TIME;
-		driver_print(KERN_WARNING,
-		             "Invalid dottime given; valid range is [%d-%d]. Defaulting to %d.\n",
-		             MIN_DOT_TIME,
-		             MAX_DOT_TIME,
-		             DEFAULT_DOT_TIME);
+static void put_ring(struct morse_ring *ring)
+{
+	kref_put(&ring->ref, release_ring);
+}
+
+// Must be called with quota_lock held.
+static struct morse_quota *find_quota(struct mem_cgroup *memcg)
+{
+	struct morse_quota *quota;
+
+	hash_for_each_possible(quotas, quota, node, (unsigned long)memcg) {
+		if (quota->memcg == memcg) {
+			return quota;
+		}
 	}
-	// Register as a misc driver
-	returnVal = misc_register(&my_miscdevice);
-	// Register new LED mode
-	led_trigger_register_simple("morse-code", &led_trigger);
-	return returnVal;
+	return NULL;
 }
 
-static void __exit my_exit(void)
+// Counts the prepared message against its cgroup, if any cap is set.
+// Returns -EDQUOT if it would take the cgroup over one.
+static int charge_quota(struct morse_msg *msg)
 {
+	unsigned int max_airtime_ms = READ_ONCE(cgroup_max_airtime_ms);
+	unsigned int max_bytes = READ_ONCE(cgroup_max_bytes);
+	struct morse_quota *quota;
+	struct morse_quota *spare = NULL;
+	struct morse_quota *unused = NULL;
+	int ret = 0;
+
+	if ((!max_airtime_ms && !max_bytes) || !msg->memcg) {
+		return 0;
+	}
+	spin_lock(&quota_lock);
+	quota = find_quota(msg->memcg);
+	if (!quota) {
+		spin_unlock(&quota_lock);
+		spare = kzalloc(sizeof(*spare), GFP_KERNEL_ACCOUNT);
+		if (!spare) {
+			return -ENOMEM;
+		}
+		spare->memcg = msg->memcg;
+		spin_lock(&quota_lock);
+		quota = find_quota(msg->memcg);
+		if (!quota) {
+			hash_add(quotas, &spare->node, (unsigned long)msg->memcg);
+			quota = spare;
+			spare = NULL;
+		}
+	}
+	if ((max_airtime_ms && div_u64((quota->airtime + msg->airtime) * dot_ns,
+	                               NSEC_PER_MSEC) > max_airtime_ms) ||
+	        (max_bytes && quota->bytes + msg->len > max_bytes)) {
+		ret = -EDQUOT;
+		if (!quota->nr_messages) {
+			hash_del(&quota->node);
+			unused = quota;
+		}
+	} else {
+		quota->airtime += msg->airtime;
+		quota->bytes += msg->len;
+		quota->nr_messages++;
+		msg->quota = quota;
+	}
+	spin_unlock(&quota_lock);
+	kfree(spare);
+	kfree(unused);
+	if (ret) {
+		stats_add(msg->channel, quota_rejects, 1);
+	}
+	return ret;
+}
+
+static void uncharge_quota(struct morse_msg *msg)
+{
+	struct morse_quota *quota = msg->quota;
+	struct morse_quota *unused = NULL;
+
+	spin_lock(&quota_lock);
+	quota->airtime -= msg->airtime;
+	quota->bytes -= msg->len;
+	if (!--quota->nr_messages) {
+		hash_del(&quota->node);
+		unused = quota;
+	}
+	spin_unlock(&quota_lock);
+	kfree(unused);
+}
+
+static void release_ldisc(struct kref *ref)
+{
+	struct morse_ldisc *ldisc = container_of(ref, struct morse_ldisc, ref);
+
+	mem_cgroup_put(ldisc->memcg);
+	kfree(ldisc);
+}
+
+static void put_ldisc(struct morse_ldisc *ldisc)
+{
+	kref_put(&ldisc->ref, release_ldisc);
+}
+
+static void release_link(struct kref *ref)
+{
+	kfree(container_of(ref, struct morse_link, ref));
+}
+
+static void put_link(struct morse_link *link)
+{
+	kref_put(&link->ref, release_link);
+}
+
+static void release_message(struct kref *ref)
+{
+	struct morse_msg *msg = container_of(ref, struct morse_msg, ref);
+	struct morse_chunk *chunk;
+	struct morse_chunk *next;
+
+	list_for_each_entry_safe(chunk, next, &msg->chunks, node) {
+		free_chunk(chunk);
+	}
+	if (msg->group) {
+		put_group(msg->group);
+	}
+	if (msg->ring) {
+		put_ring(msg->ring);
+	}
+	if (msg->ldisc) {
+		put_ldisc(msg->ldisc);
+	}
+	if (msg->link) {
+		put_link(msg->link);
+	}
+	if (msg->quota) {
+		uncharge_quota(msg);
+	}
+	mem_cgroup_put(msg->memcg);
+	kvfree(msg->text);
+	kfree(msg);
+}
+
+static void put_message(struct morse_msg *msg)
+{
+	kref_put(&msg->ref, release_message);
+}
+
+// Takes another reference to a memory cgroup, which may be NULL.
+static struct mem_cgroup *get_memcg(struct mem_cgroup *memcg)
+{
+#ifdef CONFIG_MEMCG
+	if (memcg) {
+		css_get(&memcg->css);
+	}
+#endif
+	return memcg;
+}
+
+// Message memory is charged to the submitter's memory cgroup: the current
+// task's, or the one set with set_active_memcg() for work done on its behalf.
+// The message's caps are those of memcg, whose reference it takes over even
+// on failure; NULL for messages the kernel originates, which are not capped.
+static struct morse_msg *alloc_message(struct morse_channel *ch, size_t len,
+                                       struct mem_cgroup *memcg)
+{
+	struct morse_msg *msg = kzalloc(sizeof(*msg), GFP_KERNEL_ACCOUNT);
+
+	if (!msg) {
+		mem_cgroup_put(memcg);
+		return NULL;
+	}
+	msg->text = kvmalloc(max_t(size_t, len, 1), GFP_KERNEL_ACCOUNT);
+	if (!msg->text) {
+		kfree(msg);
+		mem_cgroup_put(memcg);
+		return NULL;
+	}
+	msg->memcg = memcg;
+	kref_init(&msg->ref);
+	init_completion(&msg->done);
+	msg->channel = ch;
+	msg->id = atomic64_inc_return(&morse_ids);
+	INIT_LIST_HEAD(&msg->node);
+	INIT_LIST_HEAD(&msg->chunks);
+	msg->tail_dots = 1;
+	return msg;
+}
+
+#ifdef MORSECODE_BPF_FILTER
+// What a filter program sees of a message: its normalized text, and the
+// replacement it set with bpf_morsecode_set_text(), if any.
+struct morsecode_filter_ctx {
+	const char *text;
+	u32 len;
+	u32 channel;
+	u64 id;
+	char *rewrite;
+	u32 rewrite_len;
+};
+
+// The context being filtered on this CPU. Arguments of BPF_MODIFY_RETURN
+// programs are not trusted by the verifier, so the kfuncs take any pointer
+// and check it against this one instead.
+static DEFINE_PER_CPU(struct morsecode_filter_ctx *, filter_in_progress);
+
+__bpf_hook_start();
+
+// Attach point for BPF_MODIFY_RETURN programs, run on every message once it
+// is normalized. Returns MORSECODE_FILTER_ACCEPT or _DROP (see morsecode.h),
+// or a negative errno to fail the submission.
+noinline int morsecode_filter_message(struct morsecode_filter_ctx *ctx)
+{
+	int verdict = MORSECODE_FILTER_ACCEPT;
+
+	// Keep the verdict opaque, so callers do not assume it
+	barrier_var(verdict);
+	return verdict;
+}
+
+__bpf_hook_end();
+
+__bpf_kfunc_start_defs();
+
+// Copies up to buf__sz bytes of the message into buf and returns the length
+// of the whole message.
+__bpf_kfunc int bpf_morsecode_get_text(struct morsecode_filter_ctx *ctx,
+                                       char *buf, u32 buf__sz)
+{
+	if (!ctx || ctx != this_cpu_read(filter_in_progress)) {
+		return -EINVAL;
+	}
+	memcpy(buf, ctx->text, min(buf__sz, ctx->len));
+	return ctx->len;
+}
+
+// Replaces the message with text, which is normalized again afterwards.
+// Programs may not sleep here, so the copy must not either.
+__bpf_kfunc int bpf_morsecode_set_text(struct morsecode_filter_ctx *ctx,
+                                       const char *text, u32 text__sz)
+{
+	char *rewrite;
+
+	if (!ctx || ctx != this_cpu_read(filter_in_progress)) {
+		return -EINVAL;
+	}
+	rewrite = kmemdup(text, max_t(u32, text__sz, 1),
+	                  GFP_NOWAIT | __GFP_NOWARN | __GFP_ACCOUNT);
+	if (!rewrite) {
+		return -ENOMEM;
+	}
+	kfree(ctx->rewrite);
+	ctx->rewrite = rewrite;
+	ctx->rewrite_len = text__sz;
+	return 0;
+}
+
+__bpf_kfunc_end_defs();
+
+BTF_KFUNCS_START(morsecode_kfunc_ids)
+BTF_ID_FLAGS(func, bpf_morsecode_get_text)
+BTF_ID_FLAGS(func, bpf_morsecode_set_text)
+BTF_KFUNCS_END(morsecode_kfunc_ids)
+
+static const struct btf_kfunc_id_set morsecode_kfunc_set = {
+	.owner = THIS_MODULE,
+	.set = &morsecode_kfunc_ids,
+};
+
+BTF_KFUNCS_START(morsecode_fmodret_ids)
+BTF_ID_FLAGS(func, morsecode_filter_message)
+BTF_KFUNCS_END(morsecode_fmodret_ids)
+
+static const struct btf_kfunc_id_set morsecode_fmodret_set = {
+	.owner = THIS_MODULE,
+	.set = &morsecode_fmodret_ids,
+};
+
+static int register_filter_hook(void)
+{
+	int ret = register_btf_kfunc_id_set(BPF_PROG_TYPE_TRACING, &morsecode_kfunc_set);
+
+	if (ret) {
+		return ret;
+	}
+	return register_btf_fmodret_id_set(&morsecode_fmodret_set);
+}
+
+// Runs the filter hook on the normalized message, swapping in any rewrite.
+// A dropped message is left empty, so it completes without being flashed.
+static int filter_message(struct morse_msg *msg)
+{
+	struct morse_channel *ch = msg->channel;
+	struct morsecode_filter_ctx ctx = {
+		.text = msg->text,
+		.len = msg->len,
+		.channel = ch->index,
+		.id = msg->id,
+	};
+	ktime_t start = ktime_get();
+	int verdict;
+
+	// Nothing else may filter on this CPU until the hook returns
+	preempt_disable();
+	this_cpu_write(filter_in_progress, &ctx);
+	verdict = morsecode_filter_message(&ctx);
+	this_cpu_write(filter_in_progress, NULL);
+	preempt_enable();
+
+	stats_add(ch, filter_runs, 1);
+	stats_add(ch, filter_ns, ktime_to_ns(ktime_sub(ktime_get(), start)));
+	if (verdict < 0) {
+		kfree(ctx.rewrite);
+		stats_add(ch, filter_rejects, 1);
+		return verdict;
+	}
+	if (verdict == MORSECODE_FILTER_DROP) {
+		kfree(ctx.rewrite);
+		msg->len = 0;
+		stats_add(ch, filter_drops, 1);
+		return 0;
+	}
+	if (ctx.rewrite) {
+		kvfree(msg->text);
+		msg->text = ctx.rewrite;
+		msg->len = normalize_message(msg->text, ctx.rewrite_len);
+		stats_add(ch, filter_rewrites, 1);
+	}
+	return 0;
+}
+#else
+static int register_filter_hook(void)
+{
+	return 0;
+}
+
+static int filter_message(struct morse_msg *msg)
+{
+	return 0;
+}
+#endif
+
+// Normalizes, filters and compiles the count bytes of raw text in msg->text.
+static int prepare_message(struct morse_msg *msg, size_t count)
+{
+	int ret;
+
+	msg->len = normalize_message(msg->text, count);
+	ret = filter_message(msg);
+	if (ret) {
+		return ret;
+	}
+	msg->airtime = message_airtime(msg->text, msg->len) + msg->tail_dots - 1;
+	// Refuse before the timeline is allocated
+	ret = charge_quota(msg);
+	if (ret) {
+		return ret;
+	}
+	return compile_message(msg);
+}
+
+static struct morse_msg *create_message(struct morse_channel *ch,
+                                        const char __user *buff, size_t count)
+{
+	struct morse_msg *msg = alloc_message(ch, count, get_mem_cgroup_from_mm(current->mm));
+	int ret;
+
+	if (!msg) {
+		return ERR_PTR(-ENOMEM);
+	}
+	if (copy_from_user(msg->text, buff, count)) {
+		put_message(msg);
+		return ERR_PTR(-EFAULT);
+	}
+	ret = prepare_message(msg, count);
+	if (ret) {
+		put_message(msg);
+		return ERR_PTR(ret);
+	}
+	return msg;
+}
+
+static u64 backlog_ms(struct morse_channel *ch)
+{
+	return div_u64(READ_ONCE(ch->backlog_dots) * dot_ns, NSEC_PER_MSEC);
+}
+
+// Uevents can sleep, so they are sent from a work item; an event posted
+// again before the work runs is sent once.
+static void post_event(struct morse_channel *ch, int event)
+{
+	set_bit(event, &ch->pending_events);
+	schedule_work(&ch->event_work);
+}
+
+static void channel_event_work(struct work_struct *work)
+{
+	struct morse_channel *ch = container_of(work, struct morse_channel, event_work);
+	int event;
+
+	for (event = 0; event < NR_CHANNEL_EVENTS; ++event) {
+		char event_var[48];
+		char channel_var[24];
+		char value_var[48];
+		char *envp[] = { event_var, channel_var, value_var, NULL };
+
+		if (!test_and_clear_bit(event, &ch->pending_events)) {
+			continue;
+		}
+		snprintf(event_var, sizeof(event_var), "MORSECODE_EVENT=%s",
+		         channel_event_names[event]);
+		snprintf(channel_var, sizeof(channel_var), "CHANNEL=%d", ch->index);
+		if (event == CHANNEL_EVENT_WAIT_SLO) {
+			snprintf(value_var, sizeof(value_var), "WAIT_MS=%llu",
+			         div_u64(READ_ONCE(ch->slo_wait_ns), NSEC_PER_MSEC));
+		} else {
+			snprintf(value_var, sizeof(value_var), "BACKLOG_MS=%llu", backlog_ms(ch));
+		}
+		kobject_uevent_env(&ch->misc.this_device->kobj, KOBJ_CHANGE, envp);
+	}
+}
+
+// Signals the backlog crossing backlog_high_ms upwards, then once it has
+// drained to backlog_low_ms. Must be called with tx_lock held.
+static void backlog_changed(struct morse_channel *ch)
+{
+	unsigned int high_ms = READ_ONCE(ch->backlog_high_ms);
+	u64 queued_ms = backlog_ms(ch);
+
+	if (!ch->backlog_high && high_ms && queued_ms >= high_ms) {
+		ch->backlog_high = true;
+		post_event(ch, CHANNEL_EVENT_BACKLOG_HIGH);
+	} else if (ch->backlog_high && queued_ms <= READ_ONCE(ch->backlog_low_ms)) {
+		ch->backlog_high = false;
+		post_event(ch, CHANNEL_EVENT_BACKLOG_LOW);
+	}
+}
+
+// Must be called with tx_lock held.
+static void backlog_add(struct morse_msg *msg)
+{
+	msg->channel->backlog_dots += msg->airtime;
+	backlog_changed(msg->channel);
+}
+
+// Must be called with tx_lock held.
+static void backlog_sub(struct morse_msg *msg)
+{
+	msg->channel->backlog_dots -= msg->airtime;
+	backlog_changed(msg->channel);
+}
+
+// Signals a message that waited longer than wait_slo_ms to start; once per
+// run of such messages. Must be called with tx_lock held.
+static void check_wait_slo(struct morse_channel *ch, struct morse_msg *msg)
+{
+	unsigned int slo_ms = READ_ONCE(ch->wait_slo_ms);
+	u64 wait_ns = ktime_to_ns(ktime_sub(msg->started, msg->enqueued));
+
+	if (!slo_ms || wait_ns <= (u64)slo_ms * NSEC_PER_MSEC) {
+		ch->wait_slo_exceeded = false;
+		return;
+	}
+	if (!ch->wait_slo_exceeded) {
+		ch->wait_slo_exceeded = true;
+		WRITE_ONCE(ch->slo_wait_ns, wait_ns);
+		post_event(ch, CHANNEL_EVENT_WAIT_SLO);
+	}
+}
+
+static int submit_message(struct morse_msg *msg)
+{
+	struct morse_channel *ch = msg->channel;
+
+	spin_lock(&ch->tx_lock);
+	if (ch->tx_handed_off) {
+		spin_unlock(&ch->tx_lock);
+		return -ESHUTDOWN;
+	}
+	kref_get(&msg->ref);
+	msg->enqueued = ktime_get();
+	if (msg->group) {
+		list_add_tail(&msg->node, &ch->group_queue);
+	} else {
+		list_add_tail(&msg->node, &ch->tx_queue);
+	}
+	if (msg->urgent) {
+		ch->tx_urgent_queued++;
+	}
+	backlog_add(msg);
+	spin_unlock(&ch->tx_lock);
+	wake_up(&ch->tx_wait);
+	return 0;
+}
+
+// Must be called with tx_lock held.
+static void dequeue_message(struct morse_msg *msg)
+{
+	list_del_init(&msg->node);
+	if (msg->urgent) {
+		msg->channel->tx_urgent_queued--;
+	}
+	backlog_sub(msg);
+}
+
+// Sets aside a message that stopped partway, to be resumed before anything
+// but urgent messages. Must be called with tx_lock held.
+static void park_message(struct morse_msg *msg)
+{
+	struct morse_channel *ch = msg->channel;
+
+	backlog_add(msg);
+	if (!ch->tx_preempted) {
+		ch->tx_preempted = msg;
+		return;
+	}
+	list_add(&msg->node, &ch->tx_queue);
+	if (msg->urgent) {
+		ch->tx_urgent_queued++;
+	}
+}
+
+// Counts the message's transmitter in at the group's start line. The last
+// arrival sets the shared start time and releases everyone waiting on it.
+static void group_arrive(struct morse_msg *msg)
+{
+	struct morse_group *group = msg->group;
+
+	if (!group || msg->group_arrived) {
+		return;
+	}
+	msg->group_arrived = true;
+	if (atomic_dec_and_test(&group->arrivals_pending)) {
+		group->start = snap_to_grid(ktime_add_ns(ktime_get(), GROUP_START_LEAD_NS));
+		smp_store_release(&group->released, true);
+		wake_up_all(&group->wait);
+	}
+}
+
+static void abort_group(struct morse_group *group)
+{
+	WRITE_ONCE(group->aborted, true);
+	wake_up_all(&group->wait);
+}
+
+// Takes the message off the queue if the transmitter has not picked it yet.
+static void cancel_message(struct morse_msg *msg)
+{
+	struct morse_channel *ch = msg->channel;
+	bool was_queued;
+
+	spin_lock(&ch->tx_lock);
+	// While handed off the message belongs to the export in progress
+	was_queued = !ch->tx_handed_off && !list_empty(&msg->node);
+	if (was_queued) {
+		dequeue_message(msg);
+	}
+	spin_unlock(&ch->tx_lock);
+	if (was_queued) {
+		group_arrive(msg);
+		put_message(msg);
+	}
+}
+
+// Waits for the transmitter to finish the message. If the writer is killed
+// before its message has started, the message is taken off the queue.
+static int wait_for_message(struct morse_msg *msg)
+{
+	if (wait_for_completion_killable(&msg->done)) {
+		cancel_message(msg);
+		return -EINTR;
+	}
+	return msg->status;
+}
+
+// Must be called with tx_lock held.
+static struct morse_msg *pick_next_message(struct morse_channel *ch)
+{
+	struct morse_msg *msg;
+	struct morse_msg *oldest;
+	struct morse_msg *shortest;
+
+	if (ch->tx_handed_off || ch->tx_paused) {
+		return NULL;
+	}
+	// Urgent messages go first, in arrival order, then any message they
+	// interrupted, then group members in commit order, and only then the
+	// rest of the queue.
+	if (ch->tx_urgent_queued) {
+		list_for_each_entry(msg, &ch->tx_queue, node) {
+			if (msg->urgent) {
+				return msg;
+			}
+		}
+	}
+	if (ch->tx_preempted) {
+		msg = ch->tx_preempted;
+		ch->tx_preempted = NULL;
+		backlog_sub(msg);
+		return msg;
+	}
+	if (!list_empty(&ch->group_queue)) {
+		msg = list_first_entry(&ch->group_queue, struct morse_msg, node);
+		msg->policy = SCHED_POLICY_FIFO;
+		return msg;
+	}
+	if (list_empty(&ch->tx_queue)) {
+		return NULL;
+	}
+	oldest = list_first_entry(&ch->tx_queue, struct morse_msg, node);
+	oldest->policy = SCHED_POLICY_FIFO;
+	if (READ_ONCE(sched_policy) != SCHED_POLICY_SAF) {
+		return oldest;
+	}
+
+	// Aging: once the oldest message has waited long enough it goes next,
+	// so long messages cannot be starved by a stream of short ones.
+	if (ktime_ms_delta(ktime_get(), oldest->enqueued) >=
+	        READ_ONCE(saf_max_wait_ms)) {
+		oldest->policy = SCHED_POLICY_SAF;
+		return oldest;
+	}
+	shortest = oldest;
+	list_for_each_entry(msg, &ch->tx_queue, node) {
+		if (msg->airtime < shortest->airtime) {
+			shortest = msg;
+		}
+	}
+	shortest->policy = SCHED_POLICY_SAF;
+	return shortest;
+}
+
+static bool urgent_message_pending(struct morse_channel *ch)
+{
+	return READ_ONCE(ch->tx_urgent_queued) != 0;
+}
+
+// Appends to a coarse reader's private echo. Wakes a reader sleeping on a
+// watermark once it is met, or on the first echo so it can start timing
+// its latency bound. Must be called with queue_mutex held.
+static void reader_echo(struct morse_file *reader, const char *text, size_t len)
+{
+	struct morse_channel *ch = reader->channel;
+	bool was_empty = kfifo_is_empty(&reader->echo_fifo);
+	unsigned int copied = kfifo_in(&reader->echo_fifo, text, len);
+
+	if (copied < len) {
+		stats_add(ch, drops, len - copied);
+	}
+	if (was_empty) {
+		reader->echo_first_unread = ktime_get();
+	}
+	if (wq_has_sleeper(&reader->echo_wait) &&
+	        ((was_empty && reader->max_latency_ns) ||
+	         kfifo_len(&reader->echo_fifo) >= reader->low_wm)) {
+		wake_up_interruptible(&reader->echo_wait);
+		stats_add(ch, reader_wakeups, 1);
+	}
+}
+
+// Feeds character and word readers from the run just played; msg->pos
+// still indexes the letter or space it stood for.
+static void echo_text(struct morse_msg *msg, u8 run)
+{
+	struct morse_channel *ch = msg->channel;
+	const char *text = msg->text;
+	size_t pos = msg->pos;
+	struct morse_file *reader;
+
+	if (!(run & (RUN_LETTER_END | RUN_WORD_GAP)) ||
+	        list_empty_careful(&ch->coarse_readers)) {
+		return;
+	}
+	mutex_lock(&ch->queue_mutex);
+	list_for_each_entry(reader, &ch->coarse_readers, coarse_node) {
+		size_t start = pos;
+
+		switch (reader->echo_granularity) {
+		case MORSECODE_ECHO_CHARACTERS:
+			reader_echo(reader, &text[pos], 1);
+			break;
+		case MORSECODE_ECHO_WORDS:
+			if (run & RUN_WORD_GAP) {
+				reader_echo(reader, &text[pos], 1);
+				break;
+			}
+			if (pos + 1 < msg->len && text[pos + 1] != SEPARATOR_SYMBOL) {
+				break;
+			}
+			while (start > 0 && text[start - 1] != SEPARATOR_SYMBOL) {
+				start--;
+			}
+			reader_echo(reader, &text[start], pos + 1 - start);
+			break;
+		}
+	}
+	mutex_unlock(&ch->queue_mutex);
+}
+
+// Ends the message's line for character and word readers, and reports it
+// to message readers.
+static void echo_message_done(struct morse_msg *msg)
+{
+	struct morse_channel *ch = msg->channel;
+	struct morse_file *reader;
+	char line[32];
+	int len;
+
+	if (list_empty_careful(&ch->coarse_readers)) {
+		return;
+	}
+	len = scnprintf(line, sizeof(line), "%llu %d\n", msg->id, msg->status);
+	mutex_lock(&ch->queue_mutex);
+	list_for_each_entry(reader, &ch->coarse_readers, coarse_node) {
+		if (reader->echo_granularity == MORSECODE_ECHO_MESSAGES) {
+			reader_echo(reader, line, len);
+		} else if (msg->pos > 0) {
+			reader_echo(reader, "\n", 1);
+		}
+	}
+	mutex_unlock(&ch->queue_mutex);
+}
+
+// Holds the first edge of a group member until every member's transmitter
+// is ready, then sleeps until the shared start and records how late this
+// channel woke up for it.
+static int wait_for_group_start(struct morse_msg *msg)
+{
+	struct morse_channel *ch = msg->channel;
+	struct morse_group *group = msg->group;
+
+	group_arrive(msg);
+	// Other members may be busy with long messages for any time, so the
+	// wait must not look like a hung task
+	wait_event_idle(group->wait, smp_load_acquire(&group->released) ||
+	                             READ_ONCE(group->aborted) || kthread_should_stop());
+	if (READ_ONCE(group->aborted) || !smp_load_acquire(&group->released)) {
+		return -ECANCELED;
+	}
+	ch->tx_deadline = group->start;
+	sleep_until_deadline(ch, edge_lead_ns(ch));
+	msg->skew_ns = ktime_to_ns(ktime_sub(ktime_get(),
+	                                     ktime_sub_ns(group->start, edge_lead_ns(ch))));
+	stats_add(ch, group_messages, 1);
+	stats_add(ch, group_skew_ns, max_t(s64, 0, msg->skew_ns));
+	return 0;
+}
+
+// Notes an LED edge the last run of the message made, if it made one.
+static void record_edge(struct morse_msg *msg)
+{
+	ktime_t edge = msg->channel->last_edge;
+
+	if (ktime_before(edge, msg->started) || edge == msg->last_edge) {
+		return;
+	}
+	if (!msg->first_edge) {
+		msg->first_edge = edge;
+	}
+	msg->last_edge = edge;
+}
+
+// Plays the message's timeline from where it last stopped, waiting for
+// each chunk to finish compiling. Returns -EAGAIN if it stopped early: at a
+// word gap for an urgent message, after playing the gap, or ahead of the
+// next gap once the state is being exported. msg->pos then indexes the
+// space or letter the gap leads to, and the gap is replayed on resume.
+// Group members are never preempted, so the group stays aligned.
+static int transmit_message(struct morse_msg *msg)
+{
+	struct morse_channel *ch = msg->channel;
+	struct morse_chunk *chunk;
+
+	while ((chunk = list_first_entry_or_null(&msg->chunks,
+	                struct morse_chunk, node))) {
+		wait_for_completion(&chunk->ready);
+		start_timeline(ch);
+		if (msg->group && !msg->group_arrived) {
+			int ret = wait_for_group_start(msg);
+
+			if (ret) {
+				return ret;
+			}
+		}
+		for (; msg->run < chunk->nr_runs; ++msg->run) {
+			u8 run = chunk->runs[msg->run];
+
+			if (run & (RUN_LETTER_GAP | RUN_WORD_GAP)) {
+				if (READ_ONCE(ch->tx_handed_off) || READ_ONCE(ch->tx_paused)) {
+					return -EAGAIN;
+				}
+				if ((run & RUN_WORD_GAP) && !msg->urgent && !msg->group &&
+				        urgent_message_pending(ch)) {
+					if (play_run(ch, run)) {
+						return -EFAULT;
+					}
+					record_edge(msg);
+					stats_add(ch, preemptions, 1);
+					return -EAGAIN;
+				}
+			}
+			if (play_run(ch, run)) {
+				return -EFAULT;
+			}
+			record_edge(msg);
+			echo_text(msg, run);
+			if (run & (RUN_LETTER_END | RUN_WORD_GAP)) {
+				msg->pos++;
+			}
+		}
+		if (ktime_after(chunk->compiled, msg->encode_end)) {
+			msg->encode_end = chunk->compiled;
+		}
+		free_chunk(chunk);
+		msg->run = 0;
+	}
+	return 0;
+}
+
+static void ring_message_done(struct morse_ring *ring)
+{
+	struct morsecode_ring_header *hdr = ring->mem;
+
+	smp_store_release(&hdr->completed, atomic_inc_return(&ring->completed));
+}
+
+// Queues one ring entry. Each field is read once and the text is copied
+// out before it is normalized, so a producer rewriting the mapping
+// meanwhile can only change what it asked for, not how it is checked.
+static int queue_ring_entry(struct morse_ring *ring,
+                            const struct morsecode_ring_entry *slot)
+{
+	u32 offset = READ_ONCE(slot->offset);
+	u32 len = READ_ONCE(slot->len);
+	u32 flags = READ_ONCE(slot->flags);
+	struct morse_msg *msg;
+	int ret = 0;
+
+	if (offset > ring->text_size || len > ring->text_size - offset ||
+	        (flags & ~MORSECODE_RING_URGENT)) {
+		return -EINVAL;
+	}
+	msg = alloc_message(ring->channel, len, get_memcg(ring->memcg));
+	if (!msg) {
+		return -ENOMEM;
+	}
+	memcpy(msg->text, ring->text + offset, len);
+	ret = prepare_message(msg, len);
+	if (ret) {
+		put_message(msg);
+		return ret;
+	}
+	msg->urgent = !!(flags & MORSECODE_RING_URGENT);
+	msg->owner = ring->owner;
+	kref_get(&ring->ref);
+	msg->ring = ring;
+	if (msg->len > 0) {
+		// Nobody waits on ring messages; the queue holds the only reference
+		ret = submit_message(msg);
+	} else {
+		ring_message_done(ring);
+	}
+	if (!ret) {
+		stats_add(ring->channel, ring_messages, 1);
+	}
+	put_message(msg);
+	return ret;
+}
+
+// Queues every entry the producer has published, handing each slot back as
+// soon as it is copied. The messages are charged to the cgroup that set up
+// the ring, even when the transmitter polls it. Must be called with
+// ring->lock held.
+static void consume_ring(struct morse_ring *ring)
+{
+	struct morsecode_ring_header *hdr = ring->mem;
+	u32 tail = smp_load_acquire(&hdr->tail);
+	u32 budget = ring->entries;
+	struct mem_cgroup *old_memcg = set_active_memcg(ring->memcg);
+
+	while (ring->head != tail && budget--) {
+		if (queue_ring_entry(ring, &ring->sq[ring->head & (ring->entries - 1)])) {
+			WRITE_ONCE(hdr->rejected, ++ring->rejected);
+			stats_add(ring->channel, ring_rejected, 1);
+		}
+		ring->head++;
+		smp_store_release(&hdr->head, ring->head);
+	}
+	set_active_memcg(old_memcg);
+}
+
+// Drains the rings the transmitter polls. Before going idle it asks their
+// producers for a doorbell, then looks once more, so an entry published
+// just before the flag was seen is not left behind.
+static void poll_rings(struct morse_channel *ch, bool idle)
+{
+	struct morse_ring *ring;
+
+	mutex_lock(&ch->ring_mutex);
+	list_for_each_entry(ring, &ch->polled_rings, node) {
+		struct morsecode_ring_header *hdr = ring->mem;
+
+		WRITE_ONCE(hdr->flags, idle ? MORSECODE_RING_NEED_WAKEUP : 0);
+		smp_mb();
+		mutex_lock(&ring->lock);
+		consume_ring(ring);
+		mutex_unlock(&ring->lock);
+	}
+	mutex_unlock(&ch->ring_mutex);
+}
+
+#ifdef MORSECODE_URING_CMD
+// Kept in the pdu of an io_uring submit while its message is pending.
+struct morse_uring_pdu {
+	u64 id;                     // message to cancel if the ring goes away
+	int status;                 // handed from the transmitter to the task
+};
+
+static struct morse_uring_pdu *uring_pdu(struct io_uring_cmd *cmd)
+{
+	BUILD_BUG_ON(sizeof(struct morse_uring_pdu) > sizeof(cmd->pdu));
+	return (struct morse_uring_pdu *)cmd->pdu;
+}
+
+static void uring_cmd_done_in_task(struct io_uring_cmd *cmd, unsigned int issue_flags)
+{
+	io_uring_cmd_done(cmd, uring_pdu(cmd)->status, 0, issue_flags);
+}
+
+// Posts the CQE of an io_uring submit from the submitter's task context.
+static void complete_uring_cmd(struct io_uring_cmd *cmd, int status)
+{
+	uring_pdu(cmd)->status = status;
+	io_uring_cmd_complete_in_task(cmd, uring_cmd_done_in_task);
+}
+#endif
+
+#ifdef MORSECODE_LDISC
+// Makes room for another line, and has the tty redeliver the input it
+// held back for lack of it.
+static void ldisc_message_done(struct morse_ldisc *ldisc)
+{
+	atomic_dec(&ldisc->inflight);
+	spin_lock(&ldisc->lock);
+	if (ldisc->port && ldisc->throttled) {
+		ldisc->throttled = false;
+		tty_flip_buffer_push(ldisc->port);
+	}
+	spin_unlock(&ldisc->lock);
+}
+#endif
+
+// Accounts for a frame leaving the device, and restarts its queue if it
+// was stopped for too many frames in flight.
+static void link_frame_done(struct morse_link *link, unsigned int bytes, int status)
+{
+	struct net_device *dev;
+	unsigned long flags;
+
+	spin_lock_irqsave(&link->lock, flags);
+	link->inflight--;
+	dev = link->dev;
+	if (dev) {
+		if (status) {
+			dev->stats.tx_errors++;
+		} else {
+			dev->stats.tx_packets++;
+			dev->stats.tx_bytes += bytes;
+		}
+		netdev_completed_queue(dev, 1, bytes);
+		if (link->inflight < NET_MAX_INFLIGHT && netif_queue_stopped(dev)) {
+			netif_wake_queue(dev);
+		}
+	}
+	spin_unlock_irqrestore(&link->lock, flags);
+}
+
+static void record_latency(struct morse_msg *msg, ktime_t completed)
+{
+	struct morse_channel *ch = msg->channel;
+	struct morse_latency_record *record;
+
+	spin_lock(&ch->latency_lock);
+	record = &ch->latency_records[ch->latency_next++ % LATENCY_RECORDS];
+	record->id = msg->id;
+	record->enqueued_ns = ktime_to_ns(msg->enqueued);
+	record->encode_start_ns = ktime_to_ns(msg->encode_start);
+	record->encode_end_ns = ktime_to_ns(msg->encode_end);
+	record->first_edge_ns = ktime_to_ns(msg->first_edge);
+	record->last_edge_ns = ktime_to_ns(msg->last_edge);
+	record->completed_ns = ktime_to_ns(completed);
+	record->status = msg->status;
+	record->channel = ch->index;
+	spin_unlock(&ch->latency_lock);
+}
+
+static void finish_message(struct morse_msg *msg, int status)
+{
+	struct morse_channel *ch = msg->channel;
+	ktime_t now = ktime_get();
+
+	msg->status = status;
+	// A member that never got to play must not hold the rest of its group
+	group_arrive(msg);
+	if (msg->urgent) {
+		stats_add(ch, urgent_messages, 1);
+		stats_add(ch, urgent_latency_ns, ktime_to_ns(ktime_sub(now, msg->enqueued)));
+	}
+	stats_add(ch, policy_messages[msg->policy], 1);
+	stats_add(ch, policy_wait_ns[msg->policy],
+	          ktime_to_ns(ktime_sub(msg->started, msg->enqueued)));
+	stats_add(ch, policy_latency_ns[msg->policy],
+	          ktime_to_ns(ktime_sub(now, msg->enqueued)));
+	record_latency(msg, now);
+	if (msg->ring) {
+		ring_message_done(msg->ring);
+	}
+	echo_message_done(msg);
+	if (msg->link) {
+		link_frame_done(msg->link, msg->frame_len, status);
+	}
+#ifdef MORSECODE_LDISC
+	if (msg->ldisc) {
+		ldisc_message_done(msg->ldisc);
+	}
+#endif
+#ifdef MORSECODE_URING_CMD
+	if (msg->uring_cmd) {
+		complete_uring_cmd(msg->uring_cmd, status);
+	}
+#endif
+	complete_all(&msg->done);
+	put_message(msg);
+}
+
+static bool tx_work_pending(struct morse_channel *ch)
+{
+	return !READ_ONCE(ch->tx_handed_off) && !READ_ONCE(ch->tx_paused) &&
+	       (!list_empty(&ch->tx_queue) || !list_empty(&ch->group_queue) ||
+	        ch->tx_preempted);
+}
+
+static int transmit_thread(void *data)
+{
+	struct morse_channel *ch = data;
+
+	while (!kthread_should_stop()) {
+		struct morse_msg *msg;
+		int status;
+
+		poll_rings(ch, false);
+		if (!tx_work_pending(ch)) {
+			poll_rings(ch, true);
+			// Let the CPUs idle deeply again until there is work
+			release_cpu_latency(ch);
+		}
+		wait_event_interruptible(ch->tx_wait,
+		                         tx_work_pending(ch) || kthread_should_stop());
+
+		spin_lock(&ch->tx_lock);
+		msg = pick_next_message(ch);
+		if (msg) {
+			if (!list_empty(&msg->node)) {
+				dequeue_message(msg);
+			}
+			if (msg->pos == 0) {
+				msg->started = ktime_get();
+				check_wait_slo(ch, msg);
+			}
+		}
+		ch->tx_active = msg;
+		spin_unlock(&ch->tx_lock);
+
+		if (!msg) {
+			continue;
+		}
+		hold_cpu_latency(ch);
+		status = transmit_message(msg);
+		spin_lock(&ch->tx_lock);
+		if (status == -EAGAIN) {
+			park_message(msg);
+		}
+		ch->tx_active = NULL;
+		spin_unlock(&ch->tx_lock);
+		wake_up_all(&ch->tx_idle_wait);
+		if (status != -EAGAIN) {
+			finish_message(msg, status);
+		}
+	}
+	release_cpu_latency(ch);
+	return 0;
+}
+
+// Fails anything still queued once the transmitter has stopped.
+static void flush_tx_queue(struct morse_channel *ch)
+{
+	struct morse_msg *msg;
+	struct morse_msg *next;
+	LIST_HEAD(flushed);
+
+	spin_lock(&ch->tx_lock);
+	if (ch->tx_preempted) {
+		list_add_tail(&ch->tx_preempted->node, &flushed);
+		ch->tx_preempted = NULL;
+	}
+	list_splice_tail_init(&ch->group_queue, &flushed);
+	list_splice_tail_init(&ch->tx_queue, &flushed);
+	ch->tx_urgent_queued = 0;
+	ch->backlog_dots = 0;
+	spin_unlock(&ch->tx_lock);
+
+	list_for_each_entry_safe(msg, next, &flushed, node) {
+		list_del_init(&msg->node);
+		msg->started = ktime_get();
+		finish_message(msg, -ESHUTDOWN);
+	}
+}
+
+// Takes queued messages submitted by the file off the queue: the one with
+// the given id, or all of them if id is 0. Returns how many it took.
+static int cancel_queued_messages(struct morse_channel *ch, u64 owner, u64 id)
+{
+	struct morse_msg *msg;
+	struct morse_msg *next;
+	LIST_HEAD(cancelled);
+	int nr_cancelled = 0;
+
+	spin_lock(&ch->tx_lock);
+	// While handed off the messages belong to the export in progress
+	if (!ch->tx_handed_off) {
+		list_for_each_entry_safe(msg, next, &ch->tx_queue, node) {
+			if (msg->owner == owner && (!id || msg->id == id)) {
+				dequeue_message(msg);
+				list_add_tail(&msg->node, &cancelled);
+			}
+		}
+	}
+	spin_unlock(&ch->tx_lock);
+
+	list_for_each_entry_safe(msg, next, &cancelled, node) {
+		list_del_init(&msg->node);
+		msg->started = ktime_get();
+		finish_message(msg, -ECANCELED);
+		nr_cancelled++;
+	}
+	return nr_cancelled;
+}
+
+/******************************************************
+ * Live Upgrade
+ ******************************************************/
+// Allows pending work to survive a module upgrade: the old instance exports
+// it into a blob (see morsecode.h) and the new instance imports it.
+
+static void resume_transmitter(struct morse_channel *ch)
+{
+	spin_lock(&ch->tx_lock);
+	ch->tx_handed_off = false;
+	spin_unlock(&ch->tx_lock);
+	wake_up(&ch->tx_wait);
+}
+
+// Moves every pending message onto the list, in the order they would have
+// been sent. Must be called with tx_lock held and the transmitter parked.
+static void detach_pending_messages(struct morse_channel *ch,
+                                    struct list_head *pending)
+{
+	struct morse_msg *msg;
+	struct morse_msg *next;
+
+	if (ch->tx_preempted) {
+		list_add_tail(&ch->tx_preempted->node, pending);
+	}
+	list_for_each_entry_safe(msg, next, &ch->tx_queue, node) {
+		if (msg->urgent) {
+			dequeue_message(msg);
+			list_add_tail(&msg->node, pending);
+		}
+	}
+	list_splice_tail_init(&ch->group_queue, pending);
+	list_splice_tail_init(&ch->tx_queue, pending);
+	ch->tx_urgent_queued = 0;
+	ch->backlog_dots = 0;
+	backlog_changed(ch);
+}
+
+// Puts messages back after a failed export. Must be called with tx_lock held.
+static void reattach_pending_messages(struct morse_channel *ch,
+                                      struct list_head *pending)
+{
+	struct morse_msg *msg;
+	struct morse_msg *next;
+
+	list_for_each_entry_safe(msg, next, pending, node) {
+		list_del_init(&msg->node);
+		backlog_add(msg);
+		if (msg == ch->tx_preempted) {
+			continue;
+		}
+		list_add_tail(&msg->node, msg->group ? &ch->group_queue : &ch->tx_queue);
+		if (msg->urgent) {
+			ch->tx_urgent_queued++;
+		}
+	}
+}
+
+static int export_state(struct morse_channel *ch,
+                        struct morsecode_state_buf __user *argp)
+{
+	struct morsecode_state_buf state_buf;
+	struct morsecode_state_header header;
+	struct morse_msg *msg;
+	struct morse_msg *next;
+	LIST_HEAD(pending);
+	char *blob;
+	char *cursor;
+	size_t size;
+	int ret = 0;
+
+	if (copy_from_user(&state_buf, argp, sizeof(state_buf))) {
+		return -EFAULT;
+	}
+
+	// Park the transmitter at the next character and take all its work
+	spin_lock(&ch->tx_lock);
+	ch->tx_handed_off = true;
+	spin_unlock(&ch->tx_lock);
+	if (wait_event_interruptible(ch->tx_idle_wait, !READ_ONCE(ch->tx_active))) {
+		resume_transmitter(ch);
+		return -EINTR;
+	}
+	spin_lock(&ch->tx_lock);
+	detach_pending_messages(ch, &pending);
+	spin_unlock(&ch->tx_lock);
+
+	if (queue_lock(ch)) {
+		ret = -EINTR;
+		goto restore;
+	}
+	header.magic = MORSECODE_STATE_MAGIC;
+	header.version = MORSECODE_STATE_VERSION;
+	header.echo_len = kfifo_len(&ch->flashed_codes_queue);
+	header.nr_messages = 0;
+	size = sizeof(header) + header.echo_len;
+	list_for_each_entry(msg, &pending, node) {
+		header.nr_messages++;
+		size += sizeof(struct morsecode_state_message) + msg->len;
+	}
+
+	if (size > state_buf.size) {
+		queue_unlock(ch);
+		state_buf.size = size;
+		ret = copy_to_user(argp, &state_buf, sizeof(state_buf)) ? -EFAULT : -ENOSPC;
+		goto restore;
+	}
+	blob = kvmalloc(size, GFP_KERNEL);
+	if (!blob) {
+		queue_unlock(ch);
+		ret = -ENOMEM;
+		goto restore;
+	}
+	memcpy(blob, &header, sizeof(header));
+	cursor = blob + sizeof(header);
+	cursor += kfifo_out_peek(&ch->flashed_codes_queue, cursor, header.echo_len);
+	list_for_each_entry(msg, &pending, node) {
+		struct morsecode_state_message state_msg = {
+			.len = msg->len,
+			.pos = msg->pos,
+			.flags = (msg->urgent ? MORSECODE_STATE_URGENT : 0) |
+			         (msg == ch->tx_preempted ? MORSECODE_STATE_RESUME : 0) |
+			         (msg->link ? MORSECODE_STATE_FRAME : 0),
+			.tail_dots = msg->tail_dots,
+		};
+
+		memcpy(cursor, &state_msg, sizeof(state_msg));
+		cursor += sizeof(state_msg);
+		memcpy(cursor, msg->text, msg->len);
+		cursor += msg->len;
+	}
+
+	state_buf.size = size;
+	if (copy_to_user(u64_to_user_ptr(state_buf.data), blob, size) ||
+	        copy_to_user(argp, &state_buf, sizeof(state_buf))) {
+		queue_unlock(ch);
+		kvfree(blob);
+		ret = -EFAULT;
+		goto restore;
+	}
+	kfifo_reset(&ch->flashed_codes_queue);
+	queue_unlock(ch);
+	kvfree(blob);
+
+	// The new instance owns these messages now; their writers are done
+	spin_lock(&ch->tx_lock);
+	ch->tx_preempted = NULL;
+	spin_unlock(&ch->tx_lock);
+	list_for_each_entry_safe(msg, next, &pending, node) {
+		list_del_init(&msg->node);
+		if (msg->pos == 0) {
+			msg->started = ktime_get();
+		}
+		// Frames were not sent from this device, so must not count as sent
+		finish_message(msg, msg->link ? -ESHUTDOWN : 0);
+	}
+	driver_print(KERN_INFO, "Exported %u messages for upgrade.\n",
+	             header.nr_messages);
+	return 0;
+
+restore:
+	spin_lock(&ch->tx_lock);
+	reattach_pending_messages(ch, &pending);
+	spin_unlock(&ch->tx_lock);
+	resume_transmitter(ch);
+	return ret;
+}
+
+// Builds every message in the blob before queueing any, so a blob that is
+// cut short or malformed partway leaves the channel as it was and the
+// import can be retried.
+static int import_messages(struct morse_channel *ch, const char *cursor,
+                           const char *end, unsigned int nr_messages)
+{
+	struct morse_msg *msg;
+	struct morse_msg *next;
+	LIST_HEAD(parked);
+	LIST_HEAD(queued);
+	int ret = 0;
+
+	while (nr_messages--) {
+		struct morsecode_state_message state_msg;
+
+		if (end - cursor < sizeof(state_msg)) {
+			ret = -EINVAL;
+			goto fail;
+		}
+		memcpy(&state_msg, cursor, sizeof(state_msg));
+		cursor += sizeof(state_msg);
+		if (end - cursor < state_msg.len || state_msg.pos > state_msg.len ||
+		        state_msg.tail_dots > RUN_DOTS_MASK) {
+			ret = -EINVAL;
+			goto fail;
+		}
+
+		msg = alloc_message(ch, state_msg.len, get_mem_cgroup_from_mm(current->mm));
+		if (!msg) {
+			ret = -ENOMEM;
+			goto fail;
+		}
+		memcpy(msg->text, cursor, state_msg.len);
+		cursor += state_msg.len;
+		msg->len = normalize_message(msg->text, state_msg.len);
+		if (msg->len != state_msg.len) {
+			put_message(msg);
+			ret = -EINVAL;
+			goto fail;
+		}
+		msg->pos = state_msg.pos;
+		msg->urgent = !!(state_msg.flags & MORSECODE_STATE_URGENT);
+		// Blobs from before tail_dots was carried have 0 there
+		msg->tail_dots = max(state_msg.tail_dots, 1U);
+		msg->airtime = message_airtime(msg->text, msg->len) + msg->tail_dots - 1;
+		if (compile_message(msg)) {
+			put_message(msg);
+			ret = -ENOMEM;
+			goto fail;
+		}
+		msg->enqueued = ktime_get();
+		msg->started = msg->enqueued;
+		list_add_tail(&msg->node, (state_msg.flags & MORSECODE_STATE_RESUME) ?
+		                          &parked : &queued);
+	}
+
+	// Nobody waits on imported messages; the queue holds the only reference
+	spin_lock(&ch->tx_lock);
+	list_for_each_entry_safe(msg, next, &parked, node) {
+		list_del_init(&msg->node);
+		park_message(msg);
+	}
+	list_for_each_entry_safe(msg, next, &queued, node) {
+		list_move_tail(&msg->node, &ch->tx_queue);
+		if (msg->urgent) {
+			ch->tx_urgent_queued++;
+		}
+		backlog_add(msg);
+	}
+	spin_unlock(&ch->tx_lock);
+	return 0;
+
+fail:
+	list_splice(&parked, &queued);
+	list_for_each_entry_safe(msg, next, &queued, node) {
+		list_del_init(&msg->node);
+		put_message(msg);
+	}
+	return ret;
+}
+
+static int import_state(struct morse_channel *ch,
+                        struct morsecode_state_buf __user *argp)
+{
+	struct morsecode_state_buf state_buf;
+	struct morsecode_state_header header;
+	char *blob;
+	int ret;
+
+	if (copy_from_user(&state_buf, argp, sizeof(state_buf))) {
+		return -EFAULT;
+	}
+	if (state_buf.size < sizeof(header)) {
+		return -EINVAL;
+	}
+	blob = vmemdup_user(u64_to_user_ptr(state_buf.data), state_buf.size);
+	if (IS_ERR(blob)) {
+		return PTR_ERR(blob);
+	}
+	memcpy(&header, blob, sizeof(header));
+	if (header.magic != MORSECODE_STATE_MAGIC ||
+	        header.version != MORSECODE_STATE_VERSION ||
+	        header.echo_len > state_buf.size - sizeof(header)) {
+		kvfree(blob);
+		return -EINVAL;
+	}
+
+	if (queue_lock(ch)) {
+		kvfree(blob);
+		return -EINTR;
+	}
+	ret = import_messages(ch, blob + sizeof(header) + header.echo_len,
+	                      blob + state_buf.size, header.nr_messages);
+	// The echo comes back only with its messages, so a retry adds it once
+	if (!ret) {
+		kfifo_in(&ch->flashed_codes_queue, blob + sizeof(header), header.echo_len);
+	}
+	queue_unlock(ch);
+	kvfree(blob);
+	resume_transmitter(ch);
+	if (!ret) {
+		driver_print(KERN_INFO, "Imported %u messages from upgrade.\n",
+		             header.nr_messages);
+	}
+	return ret;
+}
+
+/******************************************************
+ * Group Commit
+ ******************************************************/
+// Starts one message on each of several channels on a shared first edge
+// (see MORSECODE_IOC_GROUP_SUBMIT in morsecode.h).
+
+static struct morse_group *alloc_group(unsigned int nr_members)
+{
+	struct morse_group *group = kzalloc(sizeof(*group), GFP_KERNEL_ACCOUNT);
+
+	if (!group) {
+		return NULL;
+	}
+	kref_init(&group->ref);
+	atomic_set(&group->arrivals_pending, nr_members);
+	init_waitqueue_head(&group->wait);
+	return group;
+}
+
+// Stops members that have not started yet; any already playing finish.
+static void cancel_group(struct morse_group *group, struct morse_msg **msgs,
+                         unsigned int nr_msgs)
+{
+	unsigned int idx;
+
+	abort_group(group);
+	for (idx = 0; idx < nr_msgs; ++idx) {
+		cancel_message(msgs[idx]);
+	}
+}
+
+static int submit_group(struct morsecode_group_submit __user *argp)
+{
+	struct morsecode_group_submit submit;
+	struct morsecode_group_entry *entries;
+	struct morse_msg *msgs[MAX_CHANNELS];
+	struct morse_group *group;
+	unsigned long used_channels = 0;
+	unsigned int nr_msgs = 0;
+	unsigned int idx;
+	int ret = 0;
+
+	if (copy_from_user(&submit, argp, sizeof(submit))) {
+		return -EFAULT;
+	}
+	if (submit.nr_entries == 0 || submit.nr_entries > channels || submit.reserved) {
+		return -EINVAL;
+	}
+	entries = memdup_user(u64_to_user_ptr(submit.entries),
+	                      submit.nr_entries * sizeof(*entries));
+	if (IS_ERR(entries)) {
+		return PTR_ERR(entries);
+	}
+	group = alloc_group(submit.nr_entries);
+	if (!group) {
+		kfree(entries);
+		return -ENOMEM;
+	}
+
+	// Build every member before queueing any, so a bad entry stages nothing
+	for (idx = 0; idx < submit.nr_entries; ++idx) {
+		struct morsecode_group_entry *entry = &entries[idx];
+		struct morse_msg *msg;
+
+		if (entry->channel >= channels ||
+		        test_and_set_bit(entry->channel, &used_channels)) {
+			ret = -EINVAL;
+			goto out;
+		}
+		// No longer than a single write() could be
+		if (entry->len > MAX_RW_COUNT) {
+			ret = -E2BIG;
+			goto out;
+		}
+		msg = create_message(morse_channels[entry->channel],
+		                     u64_to_user_ptr(entry->text), entry->len);
+		if (IS_ERR(msg)) {
+			ret = PTR_ERR(msg);
+			goto out;
+		}
+		kref_get(&group->ref);
+		msg->group = group;
+		msgs[nr_msgs++] = msg;
+	}
+
+	mutex_lock(&group_mutex);
+	for (idx = 0; idx < nr_msgs; ++idx) {
+		if (msgs[idx]->len == 0) {
+			// Nothing to flash: ready at once
+			group_arrive(msgs[idx]);
+			continue;
+		}
+		ret = submit_message(msgs[idx]);
+		if (ret) {
+			break;
+		}
+	}
+	mutex_unlock(&group_mutex);
+	if (ret) {
+		cancel_group(group, msgs, nr_msgs);
+		goto out;
+	}
+
+	for (idx = 0; idx < nr_msgs; ++idx) {
+		int status = 0;
+
+		if (msgs[idx]->len > 0) {
+			status = wait_for_message(msgs[idx]);
+		}
+		if (status == -EINTR) {
+			cancel_group(group, msgs, nr_msgs);
+			ret = status;
+			goto out;
+		}
+		if (status && !ret) {
+			ret = status;
+		}
+		entries[idx].skew_ns = msgs[idx]->skew_ns;
+	}
+	if (!ret && copy_to_user(u64_to_user_ptr(submit.entries), entries,
+	                         submit.nr_entries * sizeof(*entries))) {
+		ret = -EFAULT;
+	}
+
+out:
+	for (idx = 0; idx < nr_msgs; ++idx) {
+		put_message(msgs[idx]);
+	}
+	put_group(group);
+	kfree(entries);
+	return ret;
+}
+
+/******************************************************
+ * Submission Ring
+ ******************************************************/
+// Lets a producer queue messages through shared memory instead of a
+// write() per message (see MORSECODE_IOC_RING_SETUP in morsecode.h).
+
+static int setup_ring(struct morse_file *morse_file,
+                      struct morsecode_ring_setup __user *argp)
+{
+	struct morse_channel *ch = morse_file->channel;
+	struct morsecode_ring_setup setup;
+	struct morsecode_ring_header *hdr;
+	struct morse_ring *ring;
+	size_t text_offset;
+
+	// A ring transmits, like write()
+	if (!(morse_file->file_mode & FMODE_WRITE)) {
+		return -EBADF;
+	}
+	if (copy_from_user(&setup, argp, sizeof(setup))) {
+		return -EFAULT;
+	}
+	if (!is_power_of_2(setup.entries) || setup.entries > MAX_RING_ENTRIES ||
+	        setup.text_size == 0 || setup.text_size > MAX_RING_TEXT_SIZE ||
+	        (setup.flags & ~MORSECODE_RING_SETUP_POLL)) {
+		return -EINVAL;
+	}
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL_ACCOUNT);
+	if (!ring) {
+		return -ENOMEM;
+	}
+	text_offset = sizeof(*hdr) + setup.entries * sizeof(struct morsecode_ring_entry);
+	ring->size = PAGE_ALIGN(text_offset + setup.text_size);
+	ring->mem = vmalloc_user(ring->size);
+	if (!ring->mem) {
+		kfree(ring);
+		return -ENOMEM;
+	}
+	kref_init(&ring->ref);
+	mutex_init(&ring->lock);
+	INIT_LIST_HEAD(&ring->node);
+	ring->channel = ch;
+	ring->sq = ring->mem + sizeof(*hdr);
+	ring->text = ring->mem + text_offset;
+	ring->entries = setup.entries;
+	ring->text_size = setup.text_size;
+	ring->polled = !!(setup.flags & MORSECODE_RING_SETUP_POLL);
+	ring->owner = morse_file->id;
+	ring->memcg = get_mem_cgroup_from_mm(current->mm);
+	hdr = ring->mem;
+	hdr->entries = setup.entries;
+	hdr->text_offset = text_offset;
+	hdr->text_size = setup.text_size;
+
+	if (cmpxchg(&morse_file->ring, NULL, ring)) {
+		put_ring(ring);
+		return -EBUSY;
+	}
+	if (ring->polled) {
+		mutex_lock(&ch->ring_mutex);
+		list_add_tail(&ring->node, &ch->polled_rings);
+		mutex_unlock(&ch->ring_mutex);
+	}
+	setup.size = ring->size;
+	if (copy_to_user(argp, &setup, sizeof(setup))) {
+		return -EFAULT;
+	}
+	return 0;
+}
+
+static int enter_ring(struct morse_file *morse_file)
+{
+	struct morse_ring *ring = smp_load_acquire(&morse_file->ring);
+
+	if (!ring) {
+		return -ENXIO;
+	}
+	if (mutex_lock_interruptible(&ring->lock)) {
+		return -EINTR;
+	}
+	consume_ring(ring);
+	mutex_unlock(&ring->lock);
+	return 0;
+}
+
+static void destroy_ring(struct morse_ring *ring)
+{
+	if (ring->polled) {
+		mutex_lock(&ring->channel->ring_mutex);
+		list_del(&ring->node);
+		mutex_unlock(&ring->channel->ring_mutex);
+	}
+	put_ring(ring);
+}
+
+/******************************************************
+ * Asynchronous Control
+ ******************************************************/
+// Submit, cancel, flush and stats, shared by the ioctls and by io_uring
+// (see MORSECODE_IOC_SUBMIT and morsecode_uring_cmd in morsecode.h).
+
+// Queues a message without waiting for it. With cmd, the io_uring command
+// is completed when the message is done.
+static int submit_async(struct morse_file *morse_file,
+                        struct morsecode_submit __user *argp,
+                        struct io_uring_cmd *cmd)
+{
+	struct morsecode_submit submit;
+	struct morse_msg *msg;
+	int ret;
+
+	if (!(morse_file->file_mode & FMODE_WRITE)) {
+		return -EBADF;
+	}
+	if (copy_from_user(&submit, argp, sizeof(submit))) {
+		return -EFAULT;
+	}
+	if (submit.flags & ~MORSECODE_SUBMIT_URGENT) {
+		return -EINVAL;
+	}
+	// No longer than a single write() could be
+	if (submit.len > MAX_RW_COUNT) {
+		return -E2BIG;
+	}
+	msg = create_message(morse_file->channel, u64_to_user_ptr(submit.text), submit.len);
+	if (IS_ERR(msg)) {
+		return PTR_ERR(msg);
+	}
+	msg->urgent = (submit.flags & MORSECODE_SUBMIT_URGENT) ||
+	              morse_file->priority == MORSECODE_PRIORITY_URGENT;
+	msg->owner = morse_file->id;
+	if (put_user(msg->id, &argp->id)) {
+		put_message(msg);
+		return -EFAULT;
+	}
+	if (msg->len == 0) {
+		// Nothing to flash: done at once
+		put_message(msg);
+		return 0;
+	}
+#ifdef MORSECODE_URING_CMD
+	if (cmd) {
+		uring_pdu(cmd)->id = msg->id;
+	}
+#endif
+	msg->uring_cmd = cmd;
+	// Nobody waits on the message; the queue holds the only reference
+	ret = submit_message(msg);
+	put_message(msg);
+	if (ret) {
+		return ret;
+	}
+	return cmd ? -EIOCBQUEUED : 0;
+}
+
+static int cancel_message_by_id(struct morse_file *morse_file, u64 __user *argp)
+{
+	u64 id;
+
+	if (get_user(id, argp)) {
+		return -EFAULT;
+	}
+	if (id == 0) {
+		return -EINVAL;
+	}
+	return cancel_queued_messages(morse_file->channel, morse_file->id, id) ? 0 : -ENOENT;
+}
+
+static int copy_stats(struct morse_channel *ch, struct morsecode_stats_buf __user *argp)
+{
+	struct morsecode_stats_snapshot total;
+	struct morsecode_stats_buf stats_buf;
+
+	if (copy_from_user(&stats_buf, argp, sizeof(stats_buf))) {
+		return -EFAULT;
+	}
+	stats_snapshot(ch, &total);
+	if (copy_to_user(u64_to_user_ptr(stats_buf.data), &total,
+	                 min_t(size_t, stats_buf.size, sizeof(total)))) {
+		return -EFAULT;
+	}
+	stats_buf.size = sizeof(total);
+	if (copy_to_user(argp, &stats_buf, sizeof(stats_buf))) {
+		return -EFAULT;
+	}
+	return 0;
+}
+
+/******************************************************
+ * Echo Readers
+ ******************************************************/
+// Batched wakeups for readers that set watermarks (see
+// MORSECODE_IOC_SET_WATERMARK in morsecode.h).
+
+static enum hrtimer_restart echo_timer_expired(struct hrtimer *timer)
+{
+	struct morse_channel *ch = container_of(timer, struct morse_channel, echo_timer);
+
+	if (wq_has_sleeper(&ch->echo_wait)) {
+		wake_up_interruptible(&ch->echo_wait);
+		atomic64_inc(&ch->timer_reader_wakeups);
+	}
+	return HRTIMER_NORESTART;
+}
+
+// Must be called with queue_mutex held.
+static void update_echo_watermarks(struct morse_channel *ch)
+{
+	struct morse_file *reader;
+
+	ch->echo_wake_len = QUEUE_SIZE;
+	ch->echo_min_latency_ns = 0;
+	list_for_each_entry(reader, &ch->echo_readers, echo_node) {
+		ch->echo_wake_len = min(ch->echo_wake_len, reader->low_wm);
+		if (reader->max_latency_ns &&
+		        (!ch->echo_min_latency_ns ||
+		         reader->max_latency_ns < ch->echo_min_latency_ns)) {
+			ch->echo_min_latency_ns = reader->max_latency_ns;
+		}
+	}
+}
+
+// Takes the reader off the channel's lists before its settings change.
+// Must be called with queue_mutex held.
+static void detach_reader(struct morse_file *reader)
+{
+	list_del_init(&reader->echo_node);
+	list_del_init(&reader->coarse_node);
+}
+
+// Must be called with queue_mutex held.
+static void attach_reader(struct morse_file *reader)
+{
+	struct morse_channel *ch = reader->channel;
+
+	if (reader->echo_granularity != MORSECODE_ECHO_SYMBOLS) {
+		list_add_tail(&reader->coarse_node, &ch->coarse_readers);
+	} else if (reader->low_wm) {
+		list_add_tail(&reader->echo_node, &ch->echo_readers);
+	}
+	update_echo_watermarks(ch);
+}
+
+// Counts a file opened for reading with symbol granularity as a reader of
+// the channel's symbol echo. Must be called with queue_mutex held.
+static void set_symbol_reader(struct morse_file *reader, bool symbol_reader)
+{
+	struct morse_channel *ch = reader->channel;
+
+	if (reader->symbol_reader == symbol_reader) {
+		return;
+	}
+	reader->symbol_reader = symbol_reader;
+	if (symbol_reader) {
+		atomic_inc(&ch->symbol_readers);
+		static_branch_inc(&symbol_echo_key);
+	} else {
+		static_branch_dec(&symbol_echo_key);
+		atomic_dec(&ch->symbol_readers);
+	}
+}
+
+static struct kfifo *reader_fifo(struct morse_file *reader)
+{
+	if (READ_ONCE(reader->echo_granularity) != MORSECODE_ECHO_SYMBOLS) {
+		return &reader->echo_fifo;
+	}
+	return &reader->channel->flashed_codes_queue;
+}
+
+static wait_queue_head_t *reader_waitqueue(struct morse_file *reader)
+{
+	if (READ_ONCE(reader->echo_granularity) != MORSECODE_ECHO_SYMBOLS) {
+		return &reader->echo_wait;
+	}
+	return &reader->channel->echo_wait;
+}
+
+// A watermark must fit in the buffer the file reads at that granularity,
+// or it could never be reached.
+static bool watermark_fits(unsigned int low_wm, int granularity)
+{
+	return low_wm < (granularity == MORSECODE_ECHO_SYMBOLS ? QUEUE_SIZE : READER_QUEUE_SIZE);
+}
+
+static int set_watermark(struct morse_file *morse_file,
+                         struct morsecode_watermark __user *argp)
+{
+	struct morse_channel *ch = morse_file->channel;
+	struct morsecode_watermark watermark;
+
+	if (copy_from_user(&watermark, argp, sizeof(watermark))) {
+		return -EFAULT;
+	}
+	if (queue_lock(ch)) {
+		return -EINTR;
+	}
+	if (!watermark_fits(watermark.low_wm, morse_file->echo_granularity)) {
+		queue_unlock(ch);
+		return -EINVAL;
+	}
+	detach_reader(morse_file);
+	morse_file->low_wm = watermark.low_wm;
+	morse_file->max_latency_ns = (u64)watermark.max_latency_us * NSEC_PER_USEC;
+	attach_reader(morse_file);
+	queue_unlock(ch);
+	// Let sleepers re-check against the new settings
+	wake_up_interruptible(reader_waitqueue(morse_file));
+	return 0;
+}
+
+static int set_echo_granularity(struct morse_file *morse_file, int __user *argp)
+{
+	struct morse_channel *ch = morse_file->channel;
+	int granularity;
+
+	if (get_user(granularity, argp)) {
+		return -EFAULT;
+	}
+	if (granularity < MORSECODE_ECHO_SYMBOLS || granularity > MORSECODE_ECHO_MESSAGES) {
+		return -EINVAL;
+	}
+	if (queue_lock(ch)) {
+		return -EINTR;
+	}
+	if (!watermark_fits(morse_file->low_wm, granularity)) {
+		queue_unlock(ch);
+		return -EINVAL;
+	}
+	// The private buffer is kept once allocated
+	if (granularity != MORSECODE_ECHO_SYMBOLS && !kfifo_initialized(&morse_file->echo_fifo) &&
+	        kfifo_alloc(&morse_file->echo_fifo, READER_QUEUE_SIZE, GFP_KERNEL_ACCOUNT)) {
+		queue_unlock(ch);
+		return -ENOMEM;
+	}
+	detach_reader(morse_file);
+	if (granularity != morse_file->echo_granularity) {
+		kfifo_reset(&morse_file->echo_fifo);
+	}
+	WRITE_ONCE(morse_file->echo_granularity, granularity);
+	set_symbol_reader(morse_file, (morse_file->file_mode & FMODE_READ) &&
+	                              granularity == MORSECODE_ECHO_SYMBOLS);
+	attach_reader(morse_file);
+	queue_unlock(ch);
+	// Sleepers may be on either queue
+	wake_up_interruptible(&ch->echo_wait);
+	wake_up_interruptible(&morse_file->echo_wait);
+	return 0;
+}
+
+static void release_reader(struct morse_file *morse_file)
+{
+	struct morse_channel *ch = morse_file->channel;
+
+	mutex_lock(&ch->queue_mutex);
+	detach_reader(morse_file);
+	set_symbol_reader(morse_file, false);
+	update_echo_watermarks(ch);
+	mutex_unlock(&ch->queue_mutex);
+	kfifo_free(&morse_file->echo_fifo);
+}
+
+static ktime_t echo_deadline(struct morse_file *morse_file)
+{
+	ktime_t first_unread;
+
+	if (READ_ONCE(morse_file->echo_granularity) != MORSECODE_ECHO_SYMBOLS) {
+		first_unread = READ_ONCE(morse_file->echo_first_unread);
+	} else {
+		first_unread = READ_ONCE(morse_file->channel->echo_first_unread);
+	}
+	return ktime_add_ns(first_unread, morse_file->max_latency_ns);
+}
+
+// Whether a reader with a watermark has a batch to read. Checked without
+// queue_mutex; a stale answer only costs one more pass.
+static bool echo_ready(struct morse_file *morse_file)
+{
+	unsigned int len = kfifo_len(reader_fifo(morse_file));
+
+	if (len == 0) {
+		return false;
+	}
+	if (len >= morse_file->low_wm) {
+		return true;
+	}
+	return morse_file->max_latency_ns &&
+	       !ktime_before(ktime_get(), echo_deadline(morse_file));
+}
+
+// Sleeps until echo_ready(). While echo is buffered the reader also sleeps
+// only until its own latency bound, which may be later than echo_timer's.
+static int wait_for_echo(struct morse_file *morse_file)
+{
+	while (!echo_ready(morse_file)) {
+		ktime_t timeout = KTIME_MAX;
+		int ret;
+
+		if (!kfifo_is_empty(reader_fifo(morse_file)) && morse_file->max_latency_ns) {
+			timeout = ktime_sub(echo_deadline(morse_file), ktime_get());
+		}
+		ret = wait_event_interruptible_hrtimeout(*reader_waitqueue(morse_file),
+		                                         echo_ready(morse_file), timeout);
+		if (ret == -ERESTARTSYS) {
+			return ret;
+		}
+	}
+	return 0;
+}
+
+/******************************************************
+ * File Operation Callbacks
+ ******************************************************/
+
+static int my_open(struct inode *inode, struct file *file)
+{
+	// misc_open() leaves the miscdevice in private_data
+	struct miscdevice *misc = file->private_data;
+	struct morse_file *morse_file = kzalloc(sizeof(*morse_file), GFP_KERNEL_ACCOUNT);
+
+	if (!morse_file) {
+		return -ENOMEM;
+	}
+	morse_file->channel = container_of(misc, struct morse_channel, misc);
+	morse_file->priority = MORSECODE_PRIORITY_NORMAL;
+	morse_file->id = atomic64_inc_return(&morse_ids);
+	INIT_LIST_HEAD(&morse_file->echo_node);
+	INIT_LIST_HEAD(&morse_file->coarse_node);
+	init_waitqueue_head(&morse_file->echo_wait);
+	morse_file->file_mode = file->f_mode;
+	if (file->f_mode & FMODE_READ) {
+		mutex_lock(&morse_file->channel->queue_mutex);
+		set_symbol_reader(morse_file, true);
+		mutex_unlock(&morse_file->channel->queue_mutex);
+	}
+	file->private_data = morse_file;
+	return 0;
+}
+
+static int my_release(struct inode *inode, struct file *file)
+{
+	struct morse_file *morse_file = file->private_data;
+
+	if (morse_file->ring) {
+		destroy_ring(morse_file->ring);
+	}
+	release_reader(morse_file);
+	kfree(morse_file);
+	return 0;
+}
+
+static ssize_t my_read(struct file *file,
+                       char *buf, size_t count, loff_t *ppos)
+{
+	struct morse_file *morse_file = file->private_data;
+	struct morse_channel *ch = morse_file->channel;
+	struct kfifo *fifo = reader_fifo(morse_file);
+	unsigned int bytes_copied = 0;
+
+	if (READ_ONCE(morse_file->low_wm) && !(file->f_flags & O_NONBLOCK)) {
+		int ret = wait_for_echo(morse_file);
+
+		if (ret) {
+			return ret;
+		}
+	}
+	if (queue_lock(ch)) {
+		return -EFAULT;
+	}
+	// Coarse echo already ends each message with its own newline
+	if (fifo == &ch->flashed_codes_queue && !kfifo_is_empty(fifo)) {
+		kfifo_put(fifo, '\n');
+	}
+	if (kfifo_to_user(fifo, buf, count, &bytes_copied)) {
+		queue_unlock(ch);
+		return -EFAULT;
+	}
+	queue_unlock(ch);
+
+	*ppos += bytes_copied;
+	return bytes_copied;
+}
+
+// Sends one message written by a file and waits for it to be flashed.
+static int write_message(struct morse_channel *ch, int priority, u64 owner,
+                         const char __user *buff, size_t count)
+{
+	struct morse_msg *msg;
+	int status = 0;
+	ktime_t start_time = ktime_get();
+
+	msg = create_message(ch, buff, count);
+	if (IS_ERR(msg)) {
+		return PTR_ERR(msg);
+	}
+	msg->urgent = (priority == MORSECODE_PRIORITY_URGENT);
+	msg->owner = owner;
+	if (msg->len > 0) {
+		status = submit_message(msg);
+		if (!status) {
+			status = wait_for_message(msg);
+		}
+	}
+	put_message(msg);
+	if (status) {
+		return status;
+	}
+
+	stats_add(ch, messages, 1);
+	stats_add(ch, write_ns, ktime_to_ns(ktime_sub(ktime_get(), start_time)));
+	return 0;
+}
+
+static ssize_t my_write(struct file *file,
+                        const char *buff, size_t count, loff_t *ppos)
+{
+	struct morse_file *morse_file = file->private_data;
+	int ret = write_message(morse_file->channel, morse_file->priority,
+	                        morse_file->id, buff, count);
+
+	if (ret) {
+		return ret;
+	}
+	*ppos += count;
+	return count;
+}
+
+// Without a watermark a read never blocks, so the file is always readable.
+static __poll_t my_poll(struct file *file, poll_table *wait)
+{
+	struct morse_file *morse_file = file->private_data;
+
+	if (!READ_ONCE(morse_file->low_wm)) {
+		return EPOLLIN | EPOLLRDNORM;
+	}
+	poll_wait(file, reader_waitqueue(morse_file), wait);
+	return echo_ready(morse_file) ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+static int my_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct morse_file *morse_file = file->private_data;
+	struct morse_ring *ring = smp_load_acquire(&morse_file->ring);
+
+	if (!ring) {
+		return -ENXIO;
+	}
+	if (vma->vm_pgoff != 0) {
+		return -EINVAL;
+	}
+	return remap_vmalloc_range(vma, ring->mem, 0);
+}
+
+static long my_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct morse_file *morse_file = file->private_data;
+	struct morse_channel *ch = morse_file->channel;
+	int priority;
+	int ret;
+
+	switch (cmd) {
+	case MORSECODE_IOC_SET_PRIORITY:
+		if (get_user(priority, (int __user *)arg)) {
+			return -EFAULT;
+		}
+		if (priority != MORSECODE_PRIORITY_NORMAL &&
+		        priority != MORSECODE_PRIORITY_URGENT) {
+			return -EINVAL;
+		}
+		morse_file->priority = priority;
+		return 0;
+	case MORSECODE_IOC_EXPORT_STATE:
+	case MORSECODE_IOC_IMPORT_STATE:
+		if (!capable(CAP_SYS_ADMIN)) {
+			return -EPERM;
+		}
+		mutex_lock(&ch->state_mutex);
+		if (cmd == MORSECODE_IOC_EXPORT_STATE) {
+			ret = export_state(ch, (struct morsecode_state_buf __user *)arg);
+		} else {
+			ret = import_state(ch, (struct morsecode_state_buf __user *)arg);
+		}
+		mutex_unlock(&ch->state_mutex);
+		return ret;
+	case MORSECODE_IOC_GROUP_SUBMIT:
+		// Reaches every channel, whatever the modes of their device nodes
+		if (!(file->f_mode & FMODE_WRITE)) {
+			return -EBADF;
+		}
+		if (!capable(CAP_SYS_ADMIN)) {
+			return -EPERM;
+		}
+		return submit_group((struct morsecode_group_submit __user *)arg);
+	case MORSECODE_IOC_RING_SETUP:
+		return setup_ring(morse_file, (struct morsecode_ring_setup __user *)arg);
+	case MORSECODE_IOC_RING_ENTER:
+		return enter_ring(morse_file);
+	case MORSECODE_IOC_SUBMIT:
+		return submit_async(morse_file, (struct morsecode_submit __user *)arg, NULL);
+	case MORSECODE_IOC_CANCEL:
+		return cancel_message_by_id(morse_file, (u64 __user *)arg);
+	case MORSECODE_IOC_FLUSH:
+		return cancel_queued_messages(ch, morse_file->id, 0);
+	case MORSECODE_IOC_STATS:
+		return copy_stats(ch, (struct morsecode_stats_buf __user *)arg);
+	case MORSECODE_IOC_SET_WATERMARK:
+		return set_watermark(morse_file, (struct morsecode_watermark __user *)arg);
+	case MORSECODE_IOC_SET_ECHO:
+		return set_echo_granularity(morse_file, (int __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+#ifdef MORSECODE_URING_CMD
+static int my_uring_cmd(struct io_uring_cmd *cmd, unsigned int issue_flags)
+{
+	struct morse_file *morse_file = cmd->file->private_data;
+	const struct morsecode_uring_cmd *uring_cmd = io_uring_sqe_cmd(cmd->sqe);
+	unsigned long arg = READ_ONCE(uring_cmd->arg);
+
+	int ret;
+
+	switch (cmd->cmd_op) {
+	case MORSECODE_IOC_SUBMIT:
+		// The ring is going away: a message still queued is taken off and
+		// completes the command with -ECANCELED. One on air finishes first.
+		if (issue_flags & IO_URING_F_CANCEL) {
+			cancel_queued_messages(morse_file->channel, morse_file->id,
+			                       uring_pdu(cmd)->id);
+			return 0;
+		}
+		ret = submit_async(morse_file, (struct morsecode_submit __user *)arg, cmd);
+		// Completion runs in this task, so cannot have happened yet
+		if (ret == -EIOCBQUEUED) {
+			io_uring_cmd_mark_cancelable(cmd, issue_flags);
+		}
+		return ret;
+	case MORSECODE_IOC_CANCEL:
+	case MORSECODE_IOC_FLUSH:
+	case MORSECODE_IOC_STATS:
+		return my_ioctl(cmd->file, cmd->cmd_op, arg);
+	default:
+		return -ENOTTY;
+	}
+}
+#endif
+
+/******************************************************
+ * Sysfs attributes
+ ******************************************************/
+static struct morse_channel *dev_to_channel(struct device *dev)
+{
+	struct miscdevice *misc = dev_get_drvdata(dev);
+
+	return container_of(misc, struct morse_channel, misc);
+}
+
+static ssize_t stats_show(struct device *dev,
+                          struct device_attribute *attr, char *buf)
+{
+	struct morsecode_stats_snapshot total;
+	ssize_t len;
+	int policy;
+
+	stats_snapshot(dev_to_channel(dev), &total);
+	len = scnprintf(buf, PAGE_SIZE,
+	                "characters %llu\n"
+	                "symbols %llu\n"
+	                "drops %llu\n"
+	                "messages %llu\n"
+	                "write_ns %llu\n"
+	                "preemptions %llu\n"
+	                "urgent_messages %llu\n"
+	                "urgent_latency_ns %llu\n"
+	                "timer_wakeups %llu\n"
+	                "timer_late_ns %llu\n"
+	                "edges %llu\n"
+	                "group_messages %llu\n"
+	                "group_skew_ns %llu\n"
+	                "ring_messages %llu\n"
+	                "ring_rejected %llu\n",
+	                total.characters,
+	                total.symbols,
+	                total.drops,
+	                total.messages,
+	                total.write_ns,
+	                total.preemptions,
+	                total.urgent_messages,
+	                total.urgent_latency_ns,
+	                total.timer_wakeups,
+	                total.timer_late_ns,
+	                total.edges,
+	                total.group_messages,
+	                total.group_skew_ns,
+	                total.ring_messages,
+	                total.ring_rejected);
+	for (policy = 0; policy < NR_SCHED_POLICIES; ++policy) {
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+		                 "%s_messages %llu\n"
+		                 "%s_wait_ns %llu\n"
+		                 "%s_latency_ns %llu\n",
+		                 sched_policy_names[policy], total.policy_messages[policy],
+		                 sched_policy_names[policy], total.policy_wait_ns[policy],
+		                 sched_policy_names[policy], total.policy_latency_ns[policy]);
+	}
+	len += scnprintf(buf + len, PAGE_SIZE - len,
+	                 "reader_wakeups %llu\n"
+	                 "filter_runs %llu\n"
+	                 "filter_ns %llu\n"
+	                 "filter_drops %llu\n"
+	                 "filter_rewrites %llu\n"
+	                 "filter_rejects %llu\n"
+	                 "quota_rejects %llu\n",
+	                 total.reader_wakeups,
+	                 total.filter_runs,
+	                 total.filter_ns,
+	                 total.filter_drops,
+	                 total.filter_rewrites,
+	                 total.filter_rejects,
+	                 total.quota_rejects);
+	return len;
+}
+static DEVICE_ATTR_RO(stats);
+
+// Lists the LEDs mirroring the channel. LEDs join or leave by setting
+// their trigger, e.g. echo morse-code > /sys/class/leds/<led>/trigger
+static ssize_t leds_show(struct device *dev,
+                         struct device_attribute *attr, char *buf)
+{
+	struct morse_channel *ch = dev_to_channel(dev);
+	struct led_classdev *led_cdev;
+	ssize_t len = 0;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(led_cdev, &ch->led_trigger->led_cdevs, trig_list) {
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%s\n", led_cdev->name);
+	}
+	rcu_read_unlock();
+	return len;
+}
+static DEVICE_ATTR_RO(leds);
+
+static ssize_t backlog_ms_show(struct device *dev,
+                               struct device_attribute *attr, char *buf)
+{
+	return scnprintf(buf, PAGE_SIZE, "%llu\n", backlog_ms(dev_to_channel(dev)));
+}
+static DEVICE_ATTR_RO(backlog_ms);
+
+// Thresholds for the channel's uevents, in ms; 0 turns the event off.
+// backlog_high and backlog_low compare against the airtime queued on the
+// channel, wait_slo against how long each message waited to start.
+#define EVENT_THRESHOLD_ATTR(name) \
+	static ssize_t name##_show(struct device *dev, \
+	                           struct device_attribute *attr, char *buf) \
+	{ \
+		return scnprintf(buf, PAGE_SIZE, "%u\n", \
+		                 READ_ONCE(dev_to_channel(dev)->name)); \
+	} \
+	static ssize_t name##_store(struct device *dev, \
+	                            struct device_attribute *attr, \
+	                            const char *buf, size_t count) \
+	{ \
+		unsigned int value; \
+		int ret = kstrtouint(buf, 0, &value); \
+		\
+		if (ret) { \
+			return ret; \
+		} \
+		WRITE_ONCE(dev_to_channel(dev)->name, value); \
+		return count; \
+	} \
+	static DEVICE_ATTR_RW(name)
+
+EVENT_THRESHOLD_ATTR(backlog_high_ms);
+EVENT_THRESHOLD_ATTR(backlog_low_ms);
+EVENT_THRESHOLD_ATTR(wait_slo_ms);
+
+#define CALIBRATE_SAMPLES 16
+#define CALIBRATE_TIMEOUT_NS (100 * NSEC_PER_MSEC)
+
+// Times one edge on the channel's LEDs: the trigger call, plus the deferred
+// work that drives LEDs whose drivers sleep, which is when those actually
+// change.
+static u64 time_edge(struct morse_channel *ch, enum led_brightness brightness)
+{
+	struct led_classdev *led_cdev;
+	ktime_t start = ktime_get();
+	ktime_t timeout = ktime_add_ns(start, CALIBRATE_TIMEOUT_NS);
+	bool busy;
+
+	led_trigger_event(ch->led_trigger, brightness);
+	do {
+		busy = false;
+		rcu_read_lock();
+		list_for_each_entry_rcu(led_cdev, &ch->led_trigger->led_cdevs, trig_list) {
+			busy |= work_busy(&led_cdev->set_brightness_work) != 0;
+		}
+		rcu_read_unlock();
+		cond_resched();
+	} while (busy && ktime_before(ktime_get(), timeout));
+	return ktime_to_ns(ktime_sub(ktime_get(), start));
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	u64 x = *(const u64 *)a;
+	u64 y = *(const u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+// Parks the transmitter at its next gap and flashes the channel's LEDs to
+// take the median on and off latency as its edge compensation. The LEDs are
+// then put back as the transmitter left them. Unlike a state export, the
+// queue stays open meanwhile: messages can be submitted and cancelled, and
+// are sent once the transmitter resumes.
+static int calibrate_channel(struct morse_channel *ch)
+{
+	u64 on_ns[CALIBRATE_SAMPLES];
+	u64 off_ns[CALIBRATE_SAMPLES];
+	u64 max_comp_ns = div_u64(dot_ns, 2);
+	int i;
+	int ret = 0;
+
+	if (mutex_lock_interruptible(&ch->state_mutex)) {
+		return -EINTR;
+	}
+	spin_lock(&ch->tx_lock);
+	if (ch->tx_handed_off) {
+		spin_unlock(&ch->tx_lock);
+		ret = -EBUSY;
+		goto out;
+	}
+	ch->tx_paused = true;
+	spin_unlock(&ch->tx_lock);
+	if (wait_event_interruptible(ch->tx_idle_wait, !READ_ONCE(ch->tx_active))) {
+		ret = -EINTR;
+		goto resume;
+	}
+
+	for (i = 0; i < CALIBRATE_SAMPLES; ++i) {
+		on_ns[i] = time_edge(ch, LED_FULL);
+		off_ns[i] = time_edge(ch, LED_OFF);
+	}
+	led_trigger_event(ch->led_trigger, ch->led_state);
+	sort(on_ns, CALIBRATE_SAMPLES, sizeof(u64), cmp_u64, NULL);
+	sort(off_ns, CALIBRATE_SAMPLES, sizeof(u64), cmp_u64, NULL);
+	WRITE_ONCE(ch->edge_comp_on_ns, min(on_ns[CALIBRATE_SAMPLES / 2], max_comp_ns));
+	WRITE_ONCE(ch->edge_comp_off_ns, min(off_ns[CALIBRATE_SAMPLES / 2], max_comp_ns));
+	driver_print(KERN_INFO, "%s: edge latency %u ns on, %u ns off.\n", ch->name,
+	             ch->edge_comp_on_ns, ch->edge_comp_off_ns);
+
+resume:
+	spin_lock(&ch->tx_lock);
+	ch->tx_paused = false;
+	spin_unlock(&ch->tx_lock);
+	wake_up(&ch->tx_wait);
+out:
+	mutex_unlock(&ch->state_mutex);
+	return ret;
+}
+
+// Writing anything measures the channel's LEDs; see calibrate_channel().
+static ssize_t calibrate_store(struct device *dev,
+                               struct device_attribute *attr,
+                               const char *buf, size_t count)
+{
+	int ret = calibrate_channel(dev_to_channel(dev));
+
+	return ret ? ret : count;
+}
+static DEVICE_ATTR_WO(calibrate);
+
+// How early each edge is issued, in ns; at most half a dot time. Set by
+// calibrate, or directly from an outside measurement of the light, such as
+// a photodiode loopback or a uleds reader, which sees what the kernel
+// cannot. With tick_grid_us set they apply rounded to whole grid periods.
+#define EDGE_COMP_ATTR(name) \
+	static ssize_t name##_show(struct device *dev, \
+	                           struct device_attribute *attr, char *buf) \
+	{ \
+		return scnprintf(buf, PAGE_SIZE, "%u\n", \
+		                 READ_ONCE(dev_to_channel(dev)->name)); \
+	} \
+	static ssize_t name##_store(struct device *dev, \
+	                            struct device_attribute *attr, \
+	                            const char *buf, size_t count) \
+	{ \
+		unsigned int value; \
+		int ret = kstrtouint(buf, 0, &value); \
+		\
+		if (ret) { \
+			return ret; \
+		} \
+		if (value > div_u64(dot_ns, 2)) { \
+			return -ERANGE; \
+		} \
+		WRITE_ONCE(dev_to_channel(dev)->name, value); \
+		return count; \
+	} \
+	static DEVICE_ATTR_RW(name)
+
+EDGE_COMP_ATTR(edge_comp_on_ns);
+EDGE_COMP_ATTR(edge_comp_off_ns);
+
+// Tags offered to files on the load-balancing device, as a bit mask.
+static ssize_t tags_show(struct device *dev,
+                         struct device_attribute *attr, char *buf)
+{
+	return scnprintf(buf, PAGE_SIZE, "0x%x\n", READ_ONCE(dev_to_channel(dev)->tags));
+}
+
+static ssize_t tags_store(struct device *dev,
+                          struct device_attribute *attr,
+                          const char *buf, size_t count)
+{
+	unsigned int tags;
+	int ret = kstrtouint(buf, 0, &tags);
+
+	if (ret) {
+		return ret;
+	}
+	WRITE_ONCE(dev_to_channel(dev)->tags, tags);
+	return count;
+}
+static DEVICE_ATTR_RW(tags);
+
+static struct attribute *morsecode_attrs[] = {
+	&dev_attr_stats.attr,
+	&dev_attr_leds.attr,
+	&dev_attr_backlog_ms.attr,
+	&dev_attr_backlog_high_ms.attr,
+	&dev_attr_backlog_low_ms.attr,
+	&dev_attr_wait_slo_ms.attr,
+	&dev_attr_calibrate.attr,
+	&dev_attr_edge_comp_on_ns.attr,
+	&dev_attr_edge_comp_off_ns.attr,
+	&dev_attr_tags.attr,
+	NULL
+};
+ATTRIBUTE_GROUPS(morsecode);
+
+/******************************************************
+ * Debugfs
+ ******************************************************/
+// <debugfs>/morse-code/<channel>/latency lists the latency records of the
+// channel's recent messages, oldest first, one per line: the message id,
+// its status, and the CLOCK_MONOTONIC ns of each stage (0 if it never got
+// there). Encoding may finish after enqueueing for long messages.
+static struct dentry *morse_debugfs;
+
+static int latency_show(struct seq_file *seq, void *unused)
+{
+	struct morse_channel *ch = seq->private;
+	struct morse_latency_record *records;
+	unsigned int nr_records;
+	unsigned int first;
+	unsigned int idx;
+
+	records = kvmalloc_array(LATENCY_RECORDS, sizeof(*records), GFP_KERNEL);
+	if (!records) {
+		return -ENOMEM;
+	}
+	spin_lock(&ch->latency_lock);
+	nr_records = min_t(u64, ch->latency_next, LATENCY_RECORDS);
+	first = ch->latency_next > LATENCY_RECORDS ? ch->latency_next % LATENCY_RECORDS : 0;
+	for (idx = 0; idx < nr_records; ++idx) {
+		records[idx] = ch->latency_records[(first + idx) % LATENCY_RECORDS];
+	}
+	spin_unlock(&ch->latency_lock);
+
+	seq_puts(seq, "id status enqueued encode_start encode_end"
+	         " first_edge last_edge completed\n");
+	for (idx = 0; idx < nr_records; ++idx) {
+		struct morse_latency_record *record = &records[idx];
+
+		seq_printf(seq, "%llu %d %lld %lld %lld %lld %lld %lld\n",
+		           record->id, record->status, record->enqueued_ns,
+		           record->encode_start_ns, record->encode_end_ns,
+		           record->first_edge_ns, record->last_edge_ns,
+		           record->completed_ns);
+	}
+	kvfree(records);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(latency);
+
+/******************************************************
+ * Misc support
+ ******************************************************/
+// Callbacks:  (structure defined in /linux/fs.h)
+struct file_operations my_fops = {
+	.owner          =  THIS_MODULE,
+	.open           =  my_open,
+	.release        =  my_release,
+	.read           =  my_read,
+	.write          =  my_write,
+	.poll           =  my_poll,
+	.mmap           =  my_mmap,
+	.unlocked_ioctl =  my_ioctl,
+#ifdef MORSECODE_URING_CMD
+	.uring_cmd      =  my_uring_cmd,
+#endif
+};
+
+static struct morse_channel *create_channel(int index)
+{
+	struct morse_channel *ch = kzalloc(sizeof(*ch), GFP_KERNEL);
+	int cpu;
+	int ret;
+
+	if (!ch) {
+		return ERR_PTR(-ENOMEM);
+	}
+	ch->index = index;
+	if (index == 0) {
+		strscpy(ch->name, DEVICE_NAME, sizeof(ch->name));
+	} else {
+		snprintf(ch->name, sizeof(ch->name), DEVICE_NAME "%d", index);
+	}
+	ch->led_state = LED_OFF;
+	mutex_init(&ch->queue_mutex);
+	mutex_init(&ch->state_mutex);
+	mutex_init(&ch->ring_mutex);
+	INIT_LIST_HEAD(&ch->polled_rings);
+	INIT_LIST_HEAD(&ch->echo_readers);
+	INIT_LIST_HEAD(&ch->coarse_readers);
+	ch->echo_wake_len = QUEUE_SIZE;
+	init_waitqueue_head(&ch->echo_wait);
+	hrtimer_init(&ch->echo_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	ch->echo_timer.function = echo_timer_expired;
+	INIT_WORK(&ch->event_work, channel_event_work);
+	INIT_LIST_HEAD(&ch->tx_queue);
+	INIT_LIST_HEAD(&ch->group_queue);
+	spin_lock_init(&ch->tx_lock);
+	init_waitqueue_head(&ch->tx_wait);
+	init_waitqueue_head(&ch->tx_idle_wait);
+	spin_lock_init(&ch->latency_lock);
+
+	ch->latency_records = kvcalloc(LATENCY_RECORDS, sizeof(*ch->latency_records),
+	                               GFP_KERNEL);
+	if (!ch->latency_records) {
+		ret = -ENOMEM;
+		goto free_channel;
+	}
+	ret = kfifo_alloc(&ch->flashed_codes_queue, QUEUE_SIZE, GFP_KERNEL);
+	if (ret) {
+		goto free_records;
+	}
+	ch->stats = alloc_percpu(struct morsecode_stats);
+	if (!ch->stats) {
+		ret = -ENOMEM;
+		goto free_fifo;
+	}
+	for_each_possible_cpu(cpu) {
+		u64_stats_init(&per_cpu_ptr(ch->stats, cpu)->syncp);
+	}
+	// Register new LED mode before anything can use it. Its registration
+	// only logs why it failed, e.g. a trigger of the same name.
+	led_trigger_register_simple(ch->name, &ch->led_trigger);
+	if (!ch->led_trigger) {
+		driver_print(KERN_ERR, "Failed to register LED trigger %s.\n", ch->name);
+		ret = -EBUSY;
+		goto free_stats;
+	}
+
+	// Start the transmitter
+	ch->tx_task = kthread_run(transmit_thread, ch, "morsecode-tx/%d", index);
+	if (IS_ERR(ch->tx_task)) {
+		ret = PTR_ERR(ch->tx_task);
+		goto unregister_trigger;
+	}
+	// Register as a misc driver: /dev/<name>, /sys/class/misc/<name>/...
+	ch->misc.minor = MISC_DYNAMIC_MINOR;
+	ch->misc.name = ch->name;
+	ch->misc.fops = &my_fops;
+	ch->misc.groups = morsecode_groups;
+	ret = misc_register(&ch->misc);
+	if (ret) {
+		goto stop_thread;
+	}
+	// Debugging aids; failing to create them is not fatal
+	ch->debugfs = debugfs_create_dir(ch->name, morse_debugfs);
+	debugfs_create_file("latency", 0400, ch->debugfs, ch, &latency_fops);
+	return ch;
+
+stop_thread:
+	kthread_stop(ch->tx_task);
+unregister_trigger:
+	led_trigger_unregister_simple(ch->led_trigger);
+free_stats:
+	free_percpu(ch->stats);
+free_fifo:
+	kfifo_free(&ch->flashed_codes_queue);
+free_records:
+	kvfree(ch->latency_records);
+free_channel:
+	kfree(ch);
+	return ERR_PTR(ret);
+}
+
+static void destroy_channel(struct morse_channel *ch)
+{
+	debugfs_remove_recursive(ch->debugfs);
+	// Stop the transmitter and fail whatever it did not get to
+	kthread_stop(ch->tx_task);
+	flush_tx_queue(ch);
+	// Events are sent from the device, so finish them first
+	cancel_work_sync(&ch->event_work);
+	// Unregister misc driver
+	misc_deregister(&ch->misc);
+	// Unregister LED mode
+	led_trigger_unregister_simple(ch->led_trigger);
+	hrtimer_cancel(&ch->echo_timer);
+	free_percpu(ch->stats);
+	kfifo_free(&ch->flashed_codes_queue);
+	kvfree(ch->latency_records);
+	kfree(ch);
+}
+
+/******************************************************
+ * Network Device
+ ******************************************************/
+// morse0 carries IPv4 or IPv6 packets, without any link header, over the
+// channel picked with net_channel. Its frames are ordinary messages, so
+// they share the channel with writers, and the qdisc above it and byte
+// queue limits on it decide how much waits where. Frames come back in
+// from the straight-key decoder, if one is set up.
+static struct morse_link *morse_link;
+
+// Queues the frame as a message. Returns 0 if the message will account for
+// it when done, or an error if it was not queued.
+static int queue_frame(struct morse_link *link, struct sk_buff *skb)
+{
+	struct morse_msg *msg;
+	unsigned int idx;
+	int ret;
+
+	if (skb_linearize(skb)) {
+		return -ENOMEM;
+	}
+	msg = alloc_message(link->channel, 2 * skb->len, NULL);
+	if (!msg) {
+		return -ENOMEM;
+	}
+	// One letter per nibble, high nibble first: 0 is A, 15 is P
+	for (idx = 0; idx < skb->len; ++idx) {
+		msg->text[2 * idx] = 'A' + (skb->data[idx] >> 4);
+		msg->text[2 * idx + 1] = 'A' + (skb->data[idx] & 0x0f);
+	}
+	// Leave a word gap after the frame, which is where the receiver ends it
+	msg->tail_dots = INTER_WORD_DOTTIMES;
+	ret = prepare_message(msg, 2 * skb->len);
+	if (ret) {
+		put_message(msg);
+		return ret;
+	}
+	msg->frame_len = skb->len;
+	if (msg->len == 0) {
+		// Dropped by the filter: done at once
+		put_message(msg);
+		link_frame_done(link, skb->len, 0);
+		return 0;
+	}
+	kref_get(&link->ref);
+	msg->link = link;
+	// Nobody waits on the frame; the queue holds the only reference
+	ret = submit_message(msg);
+	put_message(msg);
+	return ret;
+}
+
+// Building a message can sleep, so frames are queued from process context.
+static void link_tx_work(struct work_struct *work)
+{
+	struct morse_link *link = container_of(work, struct morse_link, tx_work);
+	struct sk_buff *skb;
+
+	while ((skb = skb_dequeue(&link->tx_frames))) {
+		unsigned int len = skb->len;
+		int ret = queue_frame(link, skb);
+
+		if (ret) {
+			link_frame_done(link, len, ret);
+		}
+		consume_skb(skb);
+	}
+}
+
+static netdev_tx_t link_start_xmit(struct sk_buff *skb, struct net_device *dev)
+{
+	struct morse_link *link = *(struct morse_link **)netdev_priv(dev);
+	unsigned long flags;
+
+	netdev_sent_queue(dev, skb->len);
+	skb_queue_tail(&link->tx_frames, skb);
+	spin_lock_irqsave(&link->lock, flags);
+	if (++link->inflight >= NET_MAX_INFLIGHT) {
+		netif_stop_queue(dev);
+	}
+	spin_unlock_irqrestore(&link->lock, flags);
+	schedule_work(&link->tx_work);
+	return NETDEV_TX_OK;
+}
+
+static int link_open(struct net_device *dev)
+{
+	netif_start_queue(dev);
+	return 0;
+}
+
+static int link_stop(struct net_device *dev)
+{
+	netif_stop_queue(dev);
+	return 0;
+}
+
+static const struct net_device_ops link_netdev_ops = {
+	.ndo_open = link_open,
+	.ndo_stop = link_stop,
+	.ndo_start_xmit = link_start_xmit,
+};
+
+static void link_setup(struct net_device *dev)
+{
+	dev->netdev_ops = &link_netdev_ops;
+	dev->type = ARPHRD_NONE;
+	dev->flags = IFF_POINTOPOINT | IFF_NOARP;
+	dev->hard_header_len = 0;
+	dev->addr_len = 0;
+	dev->mtu = NET_DEFAULT_MTU;
+	dev->min_mtu = ETH_MIN_MTU;
+	dev->max_mtu = NET_MAX_MTU;
+	dev->tx_queue_len = 64;
+}
+
+// Hands decoded frames to the stack. netif_rx() may not run under the
+// irq-safe locks the decoder holds, so it is called from here instead.
+static void link_rx_work(struct work_struct *work)
+{
+	struct morse_link *link = container_of(work, struct morse_link, rx_work);
+	struct sk_buff *skb;
+
+	while ((skb = skb_dequeue(&link->rx_frames))) {
+		local_bh_disable();
+		netif_rx(skb);
+		local_bh_enable();
+	}
+}
+
+// Must be called with link->lock held.
+static void link_deliver_frame(struct morse_link *link)
+{
+	struct net_device *dev = link->dev;
+	struct sk_buff *skb;
+	__be16 protocol;
+
+	switch (link->rx_frame[0] >> 4) {
+	case 4:
+		protocol = htons(ETH_P_IP);
+		break;
+	case 6:
+		protocol = htons(ETH_P_IPV6);
+		break;
+	default:
+		dev->stats.rx_errors++;
+		return;
+	}
+	skb = netdev_alloc_skb(dev, link->rx_len);
+	if (!skb) {
+		dev->stats.rx_dropped++;
+		return;
+	}
+	skb_put_data(skb, link->rx_frame, link->rx_len);
+	skb->protocol = protocol;
+	skb_reset_network_header(skb);
+	dev->stats.rx_packets++;
+	dev->stats.rx_bytes += link->rx_len;
+	skb_queue_tail(&link->rx_frames, skb);
+	schedule_work(&link->rx_work);
+}
+
+// Takes a letter or space from the decoder, in interrupt context. A space
+// ends the frame; anything but A to P spoils it.
+static void link_rx_symbol(struct morse_link *link, char symbol)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&link->lock, flags);
+	if (!link->dev) {
+		goto out;
+	}
+	if (symbol == SEPARATOR_SYMBOL) {
+		if (!link->rx_bad && link->rx_nibble < 0 && link->rx_len > 0) {
+			link_deliver_frame(link);
+		} else {
+			link->dev->stats.rx_errors++;
+			link->dev->stats.rx_frame_errors++;
+		}
+		link->rx_len = 0;
+		link->rx_nibble = -1;
+		link->rx_bad = false;
+	} else if (symbol < 'A' || symbol > 'P') {
+		link->rx_bad = true;
+	} else if (link->rx_nibble < 0) {
+		link->rx_nibble = symbol - 'A';
+	} else if (link->rx_len < sizeof(link->rx_frame)) {
+		link->rx_frame[link->rx_len++] = link->rx_nibble << 4 | (symbol - 'A');
+		link->rx_nibble = -1;
+	} else {
+		link->rx_bad = true;
+	}
+out:
+	spin_unlock_irqrestore(&link->lock, flags);
+}
+
+static void destroy_link(struct morse_link *link)
+{
+	struct net_device *dev = link->dev;
+	unsigned long flags;
+
+	unregister_netdev(dev);
+	cancel_work_sync(&link->tx_work);
+	skb_queue_purge(&link->tx_frames);
+	// Frames still on the channel finish without a device
+	spin_lock_irqsave(&link->lock, flags);
+	link->dev = NULL;
+	spin_unlock_irqrestore(&link->lock, flags);
+	// No frames are decoded for it any more
+	cancel_work_sync(&link->rx_work);
+	skb_queue_purge(&link->rx_frames);
+	free_netdev(dev);
+	put_link(link);
+}
+
+// Sets up morse0 if net_channel is set; otherwise does nothing.
+static int create_link(void)
+{
+	struct morse_link *link;
+	struct net_device *dev;
+	int ret;
+
+	if (net_channel < 0) {
+		return 0;
+	}
+	if (net_channel >= channels) {
+		driver_print(KERN_ERR, "Invalid net_channel given; valid range is [0-%u].\n",
+		             channels - 1);
+		return -EINVAL;
+	}
+	link = kzalloc(sizeof(*link), GFP_KERNEL);
+	if (!link) {
+		return -ENOMEM;
+	}
+	kref_init(&link->ref);
+	spin_lock_init(&link->lock);
+	link->rx_nibble = -1;
+	link->channel = morse_channels[net_channel];
+	skb_queue_head_init(&link->tx_frames);
+	INIT_WORK(&link->tx_work, link_tx_work);
+	skb_queue_head_init(&link->rx_frames);
+	INIT_WORK(&link->rx_work, link_rx_work);
+
+	dev = alloc_netdev(sizeof(link), "morse%d", NET_NAME_ENUM, link_setup);
+	if (!dev) {
+		kfree(link);
+		return -ENOMEM;
+	}
+	*(struct morse_link **)netdev_priv(dev) = link;
+	link->dev = dev;
+	ret = register_netdev(dev);
+	if (ret) {
+		free_netdev(dev);
+		kfree(link);
+		return ret;
+	}
+	morse_link = link;
+	return 0;
+}
+
+/******************************************************
+ * Straight-Key Receiver
+ ******************************************************/
+// Keying from a GPIO line or an input device key is timestamped where it
+// arrives, in the interrupt handler or from the input core's event time,
+// and decoded right there, so scheduling latency never lands in the mark
+// and space lengths. Marks under two dot times are dots, longer ones are
+// dashes; silence of two dot times ends a letter and five end a word. The
+// dot time follows the sender, starting from the transmitters' own.
+#define RX_QUEUE_SIZE 4096
+// Longest letter, in dots and dashes.
+#define RX_MAX_SYMBOLS 4
+
+struct morse_rx {
+	struct miscdevice misc;
+	spinlock_t lock;                // decoder state, taken from hard irq
+	struct hrtimer gap_timer;       // ends letters and words in silence
+	bool key_down;
+	ktime_t last_edge;
+	u64 dot_ns;                     // current estimate
+	unsigned int code;              // 1, then a bit per symbol, 1 for a dash
+	bool in_word;                   // letters decoded since the last space
+	struct kfifo text;              // decoded letters and spaces
+	struct mutex read_mutex;        // the fifo's single consumer
+	wait_queue_head_t wait;
+	struct gpio_desc *gpio;
+	int irq;
+	bool input_registered;
+	u64 letters;
+	u64 unknown;                    // patterns that are no letter, read as '?'
+	u64 drops;                      // text lost to a full fifo
+};
+
+static struct morse_rx *morse_rx;
+
+// Inverse of letter_to_morsecode_bits_map, indexed by morse_rx.code.
+static char morsecode_to_letter[1 << (RX_MAX_SYMBOLS + 1)];
+
+static void build_reverse_table(void)
+{
+	int letter;
+
+	for (letter = 0; letter < ARRAY_SIZE(letter_to_morsecode_bits_map); ++letter) {
+		unsigned short bits = letter_to_morsecode_bits_map[letter];
+		unsigned int code = 1;
+
+		// A dash is 1110, a dot 10
+		while (bits) {
+			if ((bits & 0xe000) == 0xe000) {
+				code = code << 1 | 1;
+				bits <<= 4;
+			} else {
+				code <<= 1;
+				bits <<= 2;
+			}
+		}
+		morsecode_to_letter[code] = 'A' + letter;
+	}
+}
+
+// With a network device, received text is its frames; otherwise it is
+// for /dev/morse-rx. Must be called with rx->lock held.
+static void rx_emit(struct morse_rx *rx, char symbol)
+{
+	if (morse_link) {
+		link_rx_symbol(morse_link, symbol);
+		return;
+	}
+	if (!kfifo_put(&rx->text, symbol)) {
+		rx->drops++;
+	}
+}
+
+// Must be called with rx->lock held.
+static void rx_end_letter(struct morse_rx *rx)
+{
+	char letter = 0;
+
+	if (rx->code <= 1) {
+		return;
+	}
+	if (rx->code < ARRAY_SIZE(morsecode_to_letter)) {
+		letter = morsecode_to_letter[rx->code];
+	}
+	if (letter) {
+		rx->letters++;
+	} else {
+		letter = '?';
+		rx->unknown++;
+	}
+	rx_emit(rx, letter);
+	rx->code = 1;
+	rx->in_word = true;
+}
+
+// Ends whatever the silence since the last release (at least) closes.
+// Must be called with rx->lock held.
+static void rx_silence(struct morse_rx *rx, ktime_t now)
+{
+	u64 gap = ktime_to_ns(ktime_sub(now, rx->last_edge));
+
+	if (gap >= 2 * rx->dot_ns) {
+		rx_end_letter(rx);
+	}
+	if (gap >= 5 * rx->dot_ns && rx->in_word) {
+		rx_emit(rx, SEPARATOR_SYMBOL);
+		rx->in_word = false;
+	}
+}
+
+// Must be called with rx->lock held.
+static void rx_mark(struct morse_rx *rx, ktime_t now)
+{
+	u64 mark = ktime_to_ns(ktime_sub(now, rx->last_edge));
+	bool dash = mark >= 2 * rx->dot_ns;
+
+	// Move an eighth of the way towards the dot time this mark implies
+	rx->dot_ns = clamp_t(u64, (7 * rx->dot_ns + (dash ? div_u64(mark, 3) : mark)) / 8,
+	                     (u64)MIN_DOT_TIME_US * NSEC_PER_USEC,
+	                     (u64)MAX_DOT_TIME * NSEC_PER_MSEC);
+	// Too many symbols for a letter: keep it out of the table until it ends
+	if (rx->code < ARRAY_SIZE(morsecode_to_letter)) {
+		rx->code = rx->code << 1 | dash;
+	}
+}
+
+static void rx_key_edge(struct morse_rx *rx, bool down, ktime_t when)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&rx->lock, flags);
+	// Bounces and repeats do not change the key's state
+	if (down == rx->key_down) {
+		spin_unlock_irqrestore(&rx->lock, flags);
+		return;
+	}
+	if (down) {
+		rx_silence(rx, when);
+	} else {
+		rx_mark(rx, when);
+		hrtimer_start(&rx->gap_timer, ktime_add_ns(when, 2 * rx->dot_ns),
+		              HRTIMER_MODE_ABS);
+	}
+	rx->key_down = down;
+	rx->last_edge = when;
+	spin_unlock_irqrestore(&rx->lock, flags);
+	if (!kfifo_is_empty(&rx->text)) {
+		wake_up_interruptible(&rx->wait);
+	}
+}
+
+static enum hrtimer_restart rx_gap_expired(struct hrtimer *timer)
+{
+	struct morse_rx *rx = container_of(timer, struct morse_rx, gap_timer);
+	enum hrtimer_restart restart = HRTIMER_NORESTART;
+	unsigned long flags;
+
+	spin_lock_irqsave(&rx->lock, flags);
+	if (!rx->key_down) {
+		rx_silence(rx, ktime_get());
+		// Wait for the end of the letter, then of the word
+		if (rx->code > 1) {
+			hrtimer_set_expires(timer, ktime_add_ns(rx->last_edge, 2 * rx->dot_ns));
+			restart = HRTIMER_RESTART;
+		} else if (rx->in_word) {
+			hrtimer_set_expires(timer, ktime_add_ns(rx->last_edge, 5 * rx->dot_ns));
+			restart = HRTIMER_RESTART;
+		}
+	}
+	spin_unlock_irqrestore(&rx->lock, flags);
+	if (!kfifo_is_empty(&rx->text)) {
+		wake_up_interruptible(&rx->wait);
+	}
+	return restart;
+}
+
+static irqreturn_t key_gpio_irq(int irq, void *data)
+{
+	struct morse_rx *rx = data;
+	ktime_t now = ktime_get();
+
+	rx_key_edge(rx, gpiod_get_value(rx->gpio) != key_active_low, now);
+	return IRQ_HANDLED;
+}
+
+static void key_input_event(struct input_handle *handle, unsigned int type,
+                            unsigned int code, int value)
+{
+	ktime_t when;
+
+	// Value 2 is autorepeat
+	if (type != EV_KEY || code != key_code || value == 2) {
+		return;
+	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 4, 0)
+	when = input_get_timestamp(handle->dev)[INPUT_CLK_MONO];
+#else
+	when = ktime_get();
+#endif
+	rx_key_edge(morse_rx, value, when);
+}
+
+static bool key_input_match(struct input_handler *handler, struct input_dev *dev)
+{
+	return test_bit(key_code, dev->keybit);
+}
+
+static int key_input_connect(struct input_handler *handler, struct input_dev *dev,
+                             const struct input_device_id *id)
+{
+	struct input_handle *handle = kzalloc(sizeof(*handle), GFP_KERNEL);
+	int ret;
+
+	if (!handle) {
+		return -ENOMEM;
+	}
+	handle->dev = dev;
+	handle->handler = handler;
+	handle->name = "morse-key";
+	ret = input_register_handle(handle);
+	if (ret) {
+		goto free_handle;
+	}
+	ret = input_open_device(handle);
+	if (ret) {
+		goto unregister_handle;
+	}
+	driver_print(KERN_INFO, "Decoding key %u of %s.\n", key_code, dev->name);
+	return 0;
+
+unregister_handle:
+	input_unregister_handle(handle);
+free_handle:
+	kfree(handle);
+	return ret;
+}
+
+static void key_input_disconnect(struct input_handle *handle)
+{
+	input_close_device(handle);
+	input_unregister_handle(handle);
+	kfree(handle);
+}
+
+static const struct input_device_id key_input_ids[] = {
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT,
+		.evbit = { BIT_MASK(EV_KEY) },
+	},
+	{ },
+};
+
+static struct input_handler key_input_handler = {
+	.event = key_input_event,
+	.match = key_input_match,
+	.connect = key_input_connect,
+	.disconnect = key_input_disconnect,
+	.name = "morsecode",
+	.id_table = key_input_ids,
+};
+
+static ssize_t rx_read(struct file *file,
+                       char __user *buff, size_t count, loff_t *ppos)
+{
+	struct morse_rx *rx = container_of(file->private_data, struct morse_rx, misc);
+	unsigned int copied;
+	int ret;
+
+	if (mutex_lock_interruptible(&rx->read_mutex)) {
+		return -EINTR;
+	}
+	while (kfifo_is_empty(&rx->text)) {
+		mutex_unlock(&rx->read_mutex);
+		if (file->f_flags & O_NONBLOCK) {
+			return -EAGAIN;
+		}
+		if (wait_event_interruptible(rx->wait, !kfifo_is_empty(&rx->text))) {
+			return -EINTR;
+		}
+		if (mutex_lock_interruptible(&rx->read_mutex)) {
+			return -EINTR;
+		}
+	}
+	ret = kfifo_to_user(&rx->text, buff, count, &copied);
+	mutex_unlock(&rx->read_mutex);
+	return ret ? ret : copied;
+}
+
+static __poll_t rx_poll(struct file *file, poll_table *wait)
+{
+	struct morse_rx *rx = container_of(file->private_data, struct morse_rx, misc);
+
+	poll_wait(file, &rx->wait, wait);
+	return kfifo_is_empty(&rx->text) ? 0 : EPOLLIN | EPOLLRDNORM;
+}
+
+static const struct file_operations rx_fops = {
+	.owner = THIS_MODULE,
+	.read = rx_read,
+	.poll = rx_poll,
+	.llseek = noop_llseek,
+};
+
+static ssize_t rx_stats_show(struct device *dev,
+                             struct device_attribute *attr, char *buf)
+{
+	struct miscdevice *misc = dev_get_drvdata(dev);
+	struct morse_rx *rx = container_of(misc, struct morse_rx, misc);
+	unsigned long flags;
+	ssize_t len;
+
+	spin_lock_irqsave(&rx->lock, flags);
+	len = scnprintf(buf, PAGE_SIZE,
+	                "letters %llu\n"
+	                "unknown %llu\n"
+	                "drops %llu\n"
+	                "dot_ns %llu\n",
+	                rx->letters,
+	                rx->unknown,
+	                rx->drops,
+	                rx->dot_ns);
+	spin_unlock_irqrestore(&rx->lock, flags);
+	return len;
+}
+
+static struct device_attribute dev_attr_rx_stats = __ATTR(stats, 0444, rx_stats_show, NULL);
+
+static struct attribute *morse_rx_attrs[] = {
+	&dev_attr_rx_stats.attr,
+	NULL
+};
+ATTRIBUTE_GROUPS(morse_rx);
+
+static void destroy_receiver(struct morse_rx *rx)
+{
+	if (rx->input_registered) {
+		input_unregister_handler(&key_input_handler);
+	}
+	if (rx->irq > 0) {
+		free_irq(rx->irq, rx);
+	}
+	if (rx->gpio) {
+		gpio_free(key_gpio);
+	}
+	hrtimer_cancel(&rx->gap_timer);
+	misc_deregister(&rx->misc);
+	kfifo_free(&rx->text);
+	kfree(rx);
+}
+
+static int setup_key_gpio(struct morse_rx *rx)
+{
+	int ret = gpio_request(key_gpio, "morse-key");
+
+	if (ret) {
+		return ret;
+	}
+	rx->gpio = gpio_to_desc(key_gpio);
+	ret = gpiod_direction_input(rx->gpio);
+	if (ret) {
+		return ret;
+	}
+	// The level is read in the interrupt handler
+	if (gpiod_cansleep(rx->gpio)) {
+		driver_print(KERN_ERR, "key_gpio %d cannot be read from an interrupt.\n",
+		             key_gpio);
+		return -EINVAL;
+	}
+	ret = gpiod_to_irq(rx->gpio);
+	if (ret < 0) {
+		return ret;
+	}
+	rx->irq = ret;
+	ret = request_irq(rx->irq, key_gpio_irq, IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING,
+	                  "morse-key", rx);
+	if (ret) {
+		rx->irq = 0;
+	}
+	return ret;
+}
+
+// Sets up /dev/morse-rx if a key is configured; otherwise does nothing.
+static int create_receiver(void)
+{
+	struct morse_rx *rx;
+	int ret;
+
+	if (key_gpio < 0 && !key_code) {
+		return 0;
+	}
+	if (key_code >= KEY_CNT) {
+		driver_print(KERN_ERR, "Invalid key_code given; valid range is [1-%d].\n",
+		             KEY_CNT - 1);
+		return -EINVAL;
+	}
+	rx = kzalloc(sizeof(*rx), GFP_KERNEL);
+	if (!rx) {
+		return -ENOMEM;
+	}
+	build_reverse_table();
+	spin_lock_init(&rx->lock);
+	hrtimer_init(&rx->gap_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	rx->gap_timer.function = rx_gap_expired;
+	rx->dot_ns = dot_ns;
+	rx->code = 1;
+	mutex_init(&rx->read_mutex);
+	init_waitqueue_head(&rx->wait);
+	ret = kfifo_alloc(&rx->text, RX_QUEUE_SIZE, GFP_KERNEL);
+	if (ret) {
+		kfree(rx);
+		return ret;
+	}
+	rx->misc.minor = MISC_DYNAMIC_MINOR;
+	rx->misc.name = DEVICE_NAME "-rx";
+	rx->misc.fops = &rx_fops;
+	rx->misc.groups = morse_rx_groups;
+	ret = misc_register(&rx->misc);
+	if (ret) {
+		kfifo_free(&rx->text);
+		kfree(rx);
+		return ret;
+	}
+	morse_rx = rx;
+
+	if (key_gpio >= 0) {
+		ret = setup_key_gpio(rx);
+		if (ret) {
+			driver_print(KERN_ERR, "Failed to set up key_gpio %d.\n", key_gpio);
+			goto fail;
+		}
+	}
+	if (key_code) {
+		ret = input_register_handler(&key_input_handler);
+		if (ret) {
+			goto fail;
+		}
+		rx->input_registered = true;
+	}
+	return 0;
+
+fail:
+	destroy_receiver(rx);
+	morse_rx = NULL;
+	return ret;
+}
+
+/******************************************************
+ * TTY Line Discipline
+ ******************************************************/
+#ifdef MORSECODE_LDISC
+// Once registered (tty_ldisc) and attached to a tty, e.g. with
+// "ldattach 29 /dev/ttyS1", the discipline queues each line the tty
+// receives as a message on channel 0, or the channel picked with
+// MORSECODE_IOC_TTY_CHANNEL, straight from the tty's flip buffers. Once
+// LDISC_MAX_INFLIGHT lines wait, it accepts no more input: the rest stays
+// in the tty's buffers, which throttle the sender as they fill, and is
+// redelivered when a line finishes. Any tty owner could attach it, so like
+// n_slip and ppp it is limited to CAP_SYS_ADMIN: it reaches every channel
+// regardless of the permissions of their device nodes.
+
+// Whether another line may be queued. If not, asks for the held-back input
+// to be redelivered first and then looks again, so a line finishing in
+// between is not missed.
+static bool ldisc_has_room(struct morse_ldisc *ldisc)
+{
+	if (atomic_read(&ldisc->inflight) < LDISC_MAX_INFLIGHT) {
+		return true;
+	}
+	spin_lock(&ldisc->lock);
+	ldisc->throttled = true;
+	spin_unlock(&ldisc->lock);
+	return atomic_read(&ldisc->inflight) < LDISC_MAX_INFLIGHT;
+}
+
+// Queues the first len bytes of the buffered line and drops them from it.
+// Lines that cannot be queued are lost, like input on a tty nobody reads.
+static void queue_line(struct morse_ldisc *ldisc, size_t len)
+{
+	struct mem_cgroup *old_memcg;
+	struct morse_msg *msg;
+
+	if (!len) {
+		return;
+	}
+	old_memcg = set_active_memcg(ldisc->memcg);
+	msg = alloc_message(READ_ONCE(ldisc->channel), len, get_memcg(ldisc->memcg));
+	if (msg) {
+		memcpy(msg->text, ldisc->line, len);
+		if (prepare_message(msg, len)) {
+			put_message(msg);
+			msg = NULL;
+		}
+	}
+	set_active_memcg(old_memcg);
+	if (msg) {
+		msg->owner = ldisc->id;
+		if (msg->len > 0) {
+			kref_get(&ldisc->ref);
+			msg->ldisc = ldisc;
+			atomic_inc(&ldisc->inflight);
+			// Nobody waits on the line; the queue holds the only reference
+			if (submit_message(msg)) {
+				atomic_dec(&ldisc->inflight);
+			}
+		}
+		put_message(msg);
+	}
+	ldisc->len -= len;
+	memmove(ldisc->line, ldisc->line + len, ldisc->len);
+}
+
+// Where to split a full line: after its last word, unless that is all of it.
+static size_t line_break(struct morse_ldisc *ldisc)
+{
+	size_t idx = ldisc->len;
+
+	while (--idx > 0) {
+		if (ldisc->line[idx] == SEPARATOR_SYMBOL) {
+			return idx;
+		}
+	}
+	return ldisc->len;
+}
+
+// Returns how much of the input was taken; the tty keeps the rest.
+static size_t ldisc_receive_buf2(struct tty_struct *tty, const u8 *cp,
+                                 const u8 *fp, size_t count)
+{
+	struct morse_ldisc *ldisc = tty->disc_data;
+	size_t idx;
+
+	for (idx = 0; idx < count; ++idx) {
+		char ch = cp[idx];
+
+		// Drop characters received with framing or parity errors
+		if (fp && fp[idx] != TTY_NORMAL) {
+			continue;
+		}
+		if (ch == '\n' || ch == '\r') {
+			if (ldisc->len && !ldisc_has_room(ldisc)) {
+				break;
+			}
+			queue_line(ldisc, ldisc->len);
+			continue;
+		}
+		if (ldisc->len == LDISC_LINE_SIZE) {
+			if (!ldisc_has_room(ldisc)) {
+				break;
+			}
+			queue_line(ldisc, line_break(ldisc));
+		}
+		ldisc->line[ldisc->len++] = ch;
+	}
+	return idx;
+}
+
+static int ldisc_open(struct tty_struct *tty)
+{
+	struct morse_ldisc *ldisc;
+
+	if (!capable(CAP_SYS_ADMIN)) {
+		return -EPERM;
+	}
+	ldisc = kzalloc(sizeof(*ldisc), GFP_KERNEL_ACCOUNT);
+	if (!ldisc) {
+		return -ENOMEM;
+	}
+	kref_init(&ldisc->ref);
+	spin_lock_init(&ldisc->lock);
+	ldisc->port = tty->port;
+	ldisc->channel = morse_channels[0];
+	ldisc->memcg = get_mem_cgroup_from_mm(current->mm);
+	ldisc->id = atomic64_inc_return(&morse_ids);
+	tty->disc_data = ldisc;
+	return 0;
+}
+
+static void ldisc_close(struct tty_struct *tty)
+{
+	struct morse_ldisc *ldisc = tty->disc_data;
+
+	// What came after the last line break still goes out
+	queue_line(ldisc, ldisc->len);
+	spin_lock(&ldisc->lock);
+	ldisc->port = NULL;
+	spin_unlock(&ldisc->lock);
+	tty->disc_data = NULL;
+	put_ldisc(ldisc);
+}
+
+static int ldisc_ioctl(struct tty_struct *tty, unsigned int cmd, unsigned long arg)
+{
+	struct morse_ldisc *ldisc = tty->disc_data;
+	int index;
+
+	switch (cmd) {
+	case MORSECODE_IOC_TTY_CHANNEL:
+		if (!capable(CAP_SYS_ADMIN)) {
+			return -EPERM;
+		}
+		if (get_user(index, (int __user *)arg)) {
+			return -EFAULT;
+		}
+		if (index < 0 || index >= channels) {
+			return -EINVAL;
+		}
+		WRITE_ONCE(ldisc->channel, morse_channels[index]);
+		return 0;
+	default:
+		return n_tty_ioctl_helper(tty, cmd, arg);
+	}
+}
+
+static struct tty_ldisc_ops morse_ldisc_ops = {
+	.owner = THIS_MODULE,
+	.name = "morsecode",
+	.open = ldisc_open,
+	.close = ldisc_close,
+	.ioctl = ldisc_ioctl,
+	.receive_buf2 = ldisc_receive_buf2,
+};
+
+static int register_ldisc(void)
+{
+	int ret;
+
+	if (tty_ldisc < 0) {
+		return 0;
+	}
+	if (tty_ldisc == N_TTY || tty_ldisc >= NR_LDISCS) {
+		driver_print(KERN_ERR, "Invalid tty_ldisc given; valid range is [1-%d].\n",
+		             NR_LDISCS - 1);
+		return -EINVAL;
+	}
+	morse_ldisc_ops.num = tty_ldisc;
+	ret = tty_register_ldisc(&morse_ldisc_ops);
+	if (ret) {
+		driver_print(KERN_ERR, "Failed to register line discipline %d.\n", tty_ldisc);
+	}
+	return ret;
+}
+
+static void unregister_ldisc(void)
+{
+	if (tty_ldisc >= 0) {
+		tty_unregister_ldisc(&morse_ldisc_ops);
+	}
+}
+#else
+static int register_ldisc(void)
+{
+	if (tty_ldisc >= 0) {
+		driver_print(KERN_WARNING, "tty_ldisc needs Linux 6.6 or later; ignored.\n");
+	}
+	return 0;
+}
+
+static void unregister_ldisc(void)
+{
+}
+#endif
+
+/******************************************************
+ * Load Balancing
+ ******************************************************/
+// /dev/morse-code-any takes messages like a channel's device and sends each
+// to the channel with the least airtime ahead of it, among those whose tags
+// include the file's affinity (see MORSECODE_IOC_SET_AFFINITY).
+
+struct morse_any_file {
+	int priority;
+	u32 affinity;               // tags a channel must have; 0 for any
+	u64 id;                     // owner of the messages it submits
+};
+
+// Airtime a new message would wait for on the channel: everything queued or
+// parked, plus the whole of the message on air, whose progress is not
+// tracked. U64_MAX while the transmitter is handed off or calibrating.
+static u64 channel_load(struct morse_channel *ch)
+{
+	u64 dots = U64_MAX;
+
+	spin_lock(&ch->tx_lock);
+	if (!ch->tx_handed_off && !ch->tx_paused) {
+		dots = ch->backlog_dots;
+		if (ch->tx_active) {
+			dots += ch->tx_active->airtime;
+		}
+	}
+	spin_unlock(&ch->tx_lock);
+	return dots;
+}
+
+// Channels are compared without holding their locks together, so writers
+// racing each other may pick the same channel; the choice only has to be
+// good, not exact.
+static struct morse_channel *pick_channel(u32 affinity)
+{
+	struct morse_channel *best = NULL;
+	u64 best_load = U64_MAX;
+	int index;
+
+	for (index = 0; index < channels; ++index) {
+		struct morse_channel *ch = morse_channels[index];
+		u64 load;
+
+		if ((READ_ONCE(ch->tags) & affinity) != affinity) {
+			continue;
+		}
+		load = channel_load(ch);
+		if (load < best_load) {
+			best = ch;
+			best_load = load;
+		}
+	}
+	return best;
+}
+
+static int any_open(struct inode *inode, struct file *file)
+{
+	struct morse_any_file *any_file = kzalloc(sizeof(*any_file), GFP_KERNEL_ACCOUNT);
+
+	if (!any_file) {
+		return -ENOMEM;
+	}
+	any_file->priority = MORSECODE_PRIORITY_NORMAL;
+	any_file->id = atomic64_inc_return(&morse_ids);
+	file->private_data = any_file;
+	return 0;
+}
+
+static int any_release(struct inode *inode, struct file *file)
+{
+	kfree(file->private_data);
+	return 0;
+}
+
+static ssize_t any_write(struct file *file,
+                         const char __user *buff, size_t count, loff_t *ppos)
+{
+	struct morse_any_file *any_file = file->private_data;
+	struct morse_channel *ch = pick_channel(READ_ONCE(any_file->affinity));
+	int ret;
+
+	if (!ch) {
+		return -ENODEV;
+	}
+	ret = write_message(ch, READ_ONCE(any_file->priority), any_file->id, buff, count);
+	if (ret) {
+		return ret;
+	}
+	*ppos += count;
+	return count;
+}
+
+static long any_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct morse_any_file *any_file = file->private_data;
+	int priority;
+	u32 affinity;
+
+	switch (cmd) {
+	case MORSECODE_IOC_SET_PRIORITY:
+		if (get_user(priority, (int __user *)arg)) {
+			return -EFAULT;
+		}
+		if (priority != MORSECODE_PRIORITY_NORMAL &&
+		        priority != MORSECODE_PRIORITY_URGENT) {
+			return -EINVAL;
+		}
+		WRITE_ONCE(any_file->priority, priority);
+		return 0;
+	case MORSECODE_IOC_SET_AFFINITY:
+		if (get_user(affinity, (u32 __user *)arg)) {
+			return -EFAULT;
+		}
+		WRITE_ONCE(any_file->affinity, affinity);
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
+static const struct file_operations any_fops = {
+	.owner = THIS_MODULE,
+	.open = any_open,
+	.release = any_release,
+	.write = any_write,
+	.unlocked_ioctl = any_ioctl,
+	.llseek = noop_llseek,
+};
+
+static struct miscdevice any_misc = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = DEVICE_NAME "-any",
+	.fops = &any_fops,
+};
+
+/******************************************************
+ * Driver initialization and exit:
+ ******************************************************/
+static int __init my_init(void)
+{
+	int index;
+	int ret;
+
+	BUILD_BUG_ON(NR_SCHED_POLICIES != MORSECODE_NR_SCHED_POLICIES);
+	driver_print(KERN_INFO, "Driver initialized.\n");
+
+	// Validate dottime
+	if (dottime < MIN_DOT_TIME || dottime > MAX_DOT_TIME) {
+		dottime = DEFAULT_DOT_TIME;
+		driver_print(KERN_WARNING,
+		             "Invalid dottime given; valid range is [%d-%d]. Defaulting to %d.\n",
+		             MIN_DOT_TIME,
+		             MAX_DOT_TIME,
+		             DEFAULT_DOT_TIME);
+	}
+	dot_ns = (u64)dottime * NSEC_PER_MSEC;
+	if (dottime_us) {
+		if (dottime_us < MIN_DOT_TIME_US || dottime_us > MAX_DOT_TIME_US) {
+			driver_print(KERN_WARNING,
+			             "Invalid dottime_us given; valid range is [%d-%ld]. Using dottime.\n",
+			             MIN_DOT_TIME_US,
+			             MAX_DOT_TIME_US);
+			dottime_us = 0;
+		} else {
+			dot_ns = (u64)dottime_us * NSEC_PER_USEC;
+		}
+	}
+	// Validate tick_grid_us
+	if (tick_grid_us) {
+		u64 grid_ns = (u64)tick_grid_us * NSEC_PER_USEC;
+		u64 rem;
+
+		div64_u64_rem(dot_ns, grid_ns, &rem);
+		if (grid_ns > dot_ns || rem) {
+			driver_print(KERN_ERR,
+			             "tick_grid_us %u does not divide the dot time.\n",
+			             tick_grid_us);
+			return -EINVAL;
+		}
+		tick_grid_ns = grid_ns;
+	}
+	// Validate sched_policy
+	if (sched_policy < 0 || sched_policy >= NR_SCHED_POLICIES) {
+		sched_policy = SCHED_POLICY_FIFO;
+		driver_print(KERN_WARNING,
+		             "Invalid sched_policy given. Defaulting to fifo.\n");
+	}
+	// Validate channels
+	if (channels < 1 || channels > MAX_CHANNELS) {
+		channels = 1;
+		driver_print(KERN_WARNING,
+		             "Invalid channels given; valid range is [1-%d]. Defaulting to 1.\n",
+		             MAX_CHANNELS);
+	}
+	// Without lazy echo, every channel always wants its symbol echo
+	if (!lazy_echo) {
+		static_branch_inc(&symbol_echo_key);
+	}
+	// Let BPF programs filter and rewrite messages
+	ret = register_filter_hook();
+	if (ret) {
+		driver_print(KERN_ERR, "Failed to register the filter hook.\n");
+		goto fail_filter;
+	}
+	// Compile large messages on any idle core
+	compile_wq = alloc_workqueue("morsecode-compile", WQ_UNBOUND, 0);
+	if (!compile_wq) {
+		ret = -ENOMEM;
+		goto fail_filter;
+	}
+	morse_debugfs = debugfs_create_dir(DEVICE_NAME, NULL);
+	for (index = 0; index < channels; ++index) {
+		struct morse_channel *ch = create_channel(index);
+
+		if (IS_ERR(ch)) {
+			ret = PTR_ERR(ch);
+			goto fail_channels;
+		}
+		morse_channels[index] = ch;
+	}
+	// Expose a channel as a network device, if asked to
+	ret = create_link();
+	if (ret) {
+		goto fail_channels;
+	}
+	// Decode a straight key, if one is configured
+	ret = create_receiver();
+	if (ret) {
+		goto fail_link;
+	}
+	// Spread messages over the channels
+	ret = misc_register(&any_misc);
+	if (ret) {
+		goto fail_receiver;
+	}
+	// Let ttys stream into the channels
+	ret = register_ldisc();
+	if (ret) {
+		goto fail_any;
+	}
+	return 0;
+
+fail_any:
+	misc_deregister(&any_misc);
+fail_receiver:
+	if (morse_rx) {
+		destroy_receiver(morse_rx);
+	}
+fail_link:
+	if (morse_link) {
+		destroy_link(morse_link);
+	}
+fail_channels:
+	while (index--) {
+		destroy_channel(morse_channels[index]);
+	}
+	debugfs_remove_recursive(morse_debugfs);
+	destroy_workqueue(compile_wq);
+fail_filter:
+	if (!lazy_echo) {
+		static_branch_dec(&symbol_echo_key);
+	}
+	return ret;
+}
+
+static void __exit my_exit(void)
+{
+	int index;
+
 	driver_print(KERN_INFO, "Driver exiting.\n");
-	// Unregister LED mode
-	led_trigger_unregister_simple(led_trigger);
-	// Unregister misc driver
-	misc_deregister(&my_miscdevice);
+	unregister_ldisc();
+	misc_deregister(&any_misc);
+	if (morse_rx) {
+		destroy_receiver(morse_rx);
+	}
+	if (morse_link) {
+		destroy_link(morse_link);
+	}
+	for (index = channels - 1; index >= 0; --index) {
+		destroy_channel(morse_channels[index]);
+	}
+	debugfs_remove_recursive(morse_debugfs);
+	destroy_workqueue(compile_wq);
+	if (!lazy_echo) {
+		static_branch_dec(&symbol_echo_key);
+	}
 }
 
 module_init(my_init);
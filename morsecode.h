@@ -0,0 +1,262 @@
+#ifndef MORSECODE_H
+#define MORSECODE_H
+
+// Userspace interface of the morse-code driver (/dev/morse-code, and
+// /dev/morse-code1, /dev/morse-code2, ... when loaded with channels=N).
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define MORSECODE_IOC_MAGIC 'M'
+
+// Priorities for MORSECODE_IOC_SET_PRIORITY. Messages written through a file
+// set to MORSECODE_PRIORITY_URGENT interrupt a normal message at its next
+// word gap; the interrupted message resumes from that word afterwards.
+#define MORSECODE_PRIORITY_NORMAL 0
+#define MORSECODE_PRIORITY_URGENT 1
+
+#define MORSECODE_IOC_SET_PRIORITY _IOW(MORSECODE_IOC_MAGIC, 1, int)
+
+// Live upgrade. MORSECODE_IOC_EXPORT_STATE stops the transmitter at the next
+// character, moves every pending message, the playback position and the
+// echo backlog into a blob, and leaves the device refusing new writes with
+// ESHUTDOWN. Writers whose messages were exported return successfully. If
+// the buffer is too small, the call fails with ENOSPC, sets size to the
+// bytes needed and resumes transmission. MORSECODE_IOC_IMPORT_STATE loads a
+// blob into a (usually newly loaded) driver instance and starts transmitting
+// it. Both require CAP_SYS_ADMIN.
+struct morsecode_state_buf {
+	__u64 data;             // user pointer to the blob
+	__u32 size;             // size of the buffer; on export, size of the blob
+	__u32 reserved;
+};
+
+#define MORSECODE_IOC_EXPORT_STATE _IOWR(MORSECODE_IOC_MAGIC, 2, struct morsecode_state_buf)
+#define MORSECODE_IOC_IMPORT_STATE _IOW(MORSECODE_IOC_MAGIC, 3, struct morsecode_state_buf)
+
+// Blob layout: a header, echo_len bytes of echo backlog, then nr_messages
+// messages, each a morsecode_state_message followed by len bytes of text.
+// Messages appear in the order they will be sent.
+#define MORSECODE_STATE_MAGIC 0x4d4f5253    // "MORS"
+#define MORSECODE_STATE_VERSION 1
+
+struct morsecode_state_header {
+	__u32 magic;
+	__u32 version;
+	__u32 echo_len;
+	__u32 nr_messages;
+};
+
+#define MORSECODE_STATE_URGENT (1 << 0)
+#define MORSECODE_STATE_RESUME (1 << 1)     // was interrupted mid-message
+// A frame of the network device. The importing instance sends it as text;
+// the exporting one counts it as a transmit error, since it never went out
+// from there.
+#define MORSECODE_STATE_FRAME (1 << 2)
+
+struct morsecode_state_message {
+	__u32 len;
+	__u32 pos;              // next character to flash
+	__u32 flags;
+	__u32 tail_dots;        // off dots after the last letter, at most 15; 0 means 1
+};
+
+// Group commit. Stages one message on each of several channels (at most one
+// per channel) and starts them together: once every channel's transmitter
+// has reached its message, all of them make their first edge at the same
+// moment. Can be issued on any channel's device opened for writing, and
+// needs CAP_SYS_ADMIN since it reaches every channel. Like write(), it returns
+// once every message has been flashed, and then reports for each channel
+// how late its first edge was relative to the shared start. If any message
+// cannot be queued, or the caller is killed before the start, none of the
+// messages that have not started are sent.
+struct morsecode_group_entry {
+	__u32 channel;          // N of /dev/morse-codeN; 0 is /dev/morse-code
+	__u32 len;              // at most what one write() takes, else E2BIG
+	__u64 text;             // user pointer to the message
+	__s64 skew_ns;          // out: first edge minus the shared start
+};
+
+struct morsecode_group_submit {
+	__u32 nr_entries;
+	__u32 reserved;         // must be zero
+	__u64 entries;          // user pointer to nr_entries entries
+};
+
+#define MORSECODE_IOC_GROUP_SUBMIT _IOW(MORSECODE_IOC_MAGIC, 4, struct morsecode_group_submit)
+
+// Submission ring. MORSECODE_IOC_RING_SETUP creates a ring for the open
+// file, which must be open for writing (else EBADF), to be mmap()ed at offset 0 with setup.size bytes. The producer
+// copies message text into the text area, fills the entry at
+// tail & (entries - 1) and then advances tail. The driver copies the text
+// out, queues it like a write() nobody waits for, and advances head; an
+// entry and its text may be reused once head has passed it. Entries are
+// consumed by MORSECODE_IOC_RING_ENTER. With MORSECODE_RING_SETUP_POLL the
+// channel's transmitter also consumes them between messages, and sets
+// MORSECODE_RING_NEED_WAKEUP before it goes idle: from then on the producer
+// must call MORSECODE_IOC_RING_ENTER after advancing tail.
+#define MORSECODE_RING_SETUP_POLL (1 << 0)
+
+struct morsecode_ring_setup {
+	__u32 entries;          // power of two, at most 4096
+	__u32 text_size;        // bytes of text area, at most 1 MiB
+	__u32 flags;
+	__u32 size;             // out: bytes to mmap()
+};
+
+#define MORSECODE_IOC_RING_SETUP _IOWR(MORSECODE_IOC_MAGIC, 5, struct morsecode_ring_setup)
+#define MORSECODE_IOC_RING_ENTER _IO(MORSECODE_IOC_MAGIC, 6)
+
+#define MORSECODE_RING_NEED_WAKEUP (1 << 0)
+
+// Start of the mapping. The entries follow it, then the text area at
+// text_offset.
+struct morsecode_ring_header {
+	__u32 head;             // written by the driver
+	__u32 tail;             // written by the producer
+	__u32 flags;            // written by the driver
+	__u32 completed;        // messages from this ring done flashing
+	__u32 rejected;         // entries that could not be queued
+	__u32 entries;
+	__u32 text_offset;
+	__u32 text_size;
+};
+
+#define MORSECODE_RING_URGENT (1 << 0)
+
+struct morsecode_ring_entry {
+	__u32 offset;           // of the text, within the text area
+	__u32 len;
+	__u32 flags;
+	__u32 reserved;
+};
+
+// Asynchronous control. MORSECODE_IOC_SUBMIT queues a message and returns
+// at once with its id; MORSECODE_IOC_CANCEL takes a message submitted
+// through the same file off the queue by id, failing with ENOENT once it
+// has started; MORSECODE_IOC_FLUSH does so for every message of the file
+// still queued and returns how many it took. Writers and io_uring
+// submissions whose message is taken off the queue fail with ECANCELED.
+// Submitting needs the file open for writing, else it fails with EBADF.
+#define MORSECODE_SUBMIT_URGENT (1 << 0)
+
+struct morsecode_submit {
+	__u64 text;             // user pointer to the message
+	__u32 len;              // at most what one write() takes, else E2BIG
+	__u32 flags;
+	__u64 id;               // out
+};
+
+#define MORSECODE_IOC_SUBMIT _IOWR(MORSECODE_IOC_MAGIC, 7, struct morsecode_submit)
+#define MORSECODE_IOC_CANCEL _IOW(MORSECODE_IOC_MAGIC, 8, __u64)
+#define MORSECODE_IOC_FLUSH _IO(MORSECODE_IOC_MAGIC, 9)
+
+// MORSECODE_IOC_STATS copies up to size bytes of the channel's counters,
+// the same ones as its "stats" sysfs attribute, and sets size to the full
+// size of the snapshot. New counters are only ever added at the end.
+#define MORSECODE_NR_SCHED_POLICIES 2     // fifo, saf
+
+struct morsecode_stats_snapshot {
+	__u64 characters;       // letters flashed
+	__u64 symbols;          // dots and dashes flashed
+	__u64 drops;            // echo symbols lost to a full queue
+	__u64 messages;         // completed writes
+	__u64 write_ns;         // total time spent in write()
+	__u64 preemptions;      // messages interrupted by an urgent one
+	__u64 urgent_messages;
+	__u64 urgent_latency_ns;    // enqueue to completion of urgent messages
+	__u64 timer_wakeups;    // dot-time waits by the transmitter
+	__u64 timer_late_ns;    // total time woken past the scheduled edge
+	__u64 edges;            // LED state changes, each applied to every LED
+	__u64 group_messages;   // group members started on a shared edge
+	__u64 group_skew_ns;    // total time their first edge was late
+	__u64 ring_messages;    // messages queued from submission rings
+	__u64 ring_rejected;    // ring entries that could not be queued
+	__u64 policy_messages[MORSECODE_NR_SCHED_POLICIES];
+	__u64 policy_wait_ns[MORSECODE_NR_SCHED_POLICIES];      // enqueue to first symbol
+	__u64 policy_latency_ns[MORSECODE_NR_SCHED_POLICIES];   // enqueue to completion
+	__u64 reader_wakeups;   // wakeups of readers blocked on their watermarks
+	__u64 filter_runs;      // messages passed to the BPF filter hook
+	__u64 filter_ns;        // total time spent in it
+	__u64 filter_drops;
+	__u64 filter_rewrites;
+	__u64 filter_rejects;
+	__u64 quota_rejects;    // submissions over a cgroup cap
+};
+
+struct morsecode_stats_buf {
+	__u64 data;             // user pointer to a morsecode_stats_snapshot
+	__u32 size;
+	__u32 reserved;
+};
+
+#define MORSECODE_IOC_STATS _IOWR(MORSECODE_IOC_MAGIC, 10, struct morsecode_stats_buf)
+
+// Reader watermarks. By default read() never blocks and returns whatever
+// echo is buffered, possibly nothing. After MORSECODE_IOC_SET_WATERMARK
+// with a non-zero low_wm, read() on the file blocks (unless O_NONBLOCK)
+// and poll() waits until at least low_wm bytes of echo are buffered, or
+// max_latency_us has passed since the oldest unread one, if that is set.
+// Readers are then woken once per batch rather than once per symbol.
+// low_wm of 0 restores the default. low_wm is at most 32767 for the symbol
+// echo and 4095 for coarser granularities (see MORSECODE_IOC_SET_ECHO), and
+// either ioctl fails with EINVAL if the two would not fit.
+struct morsecode_watermark {
+	__u32 low_wm;           // bytes
+	__u32 max_latency_us;   // 0 waits for low_wm only
+};
+
+#define MORSECODE_IOC_SET_WATERMARK _IOW(MORSECODE_IOC_MAGIC, 11, struct morsecode_watermark)
+
+// Echo granularity, set per file with MORSECODE_IOC_SET_ECHO. Symbols is the
+// shared stream of '.', '-' and ' ' that every reader sees by default.
+// Coarser readers get their own buffer instead, holding the letters as they
+// are flashed with a space between words, or each word once it is complete,
+// and a '\n' after each message in both cases; or one "<id> <status>\n"
+// line per finished message, with its id from MORSECODE_IOC_SUBMIT (every
+// message has one) and 0 or a negative errno. Watermarks apply to whichever
+// buffer the file reads.
+#define MORSECODE_ECHO_SYMBOLS 0
+#define MORSECODE_ECHO_CHARACTERS 1
+#define MORSECODE_ECHO_WORDS 2
+#define MORSECODE_ECHO_MESSAGES 3
+
+#define MORSECODE_IOC_SET_ECHO _IOW(MORSECODE_IOC_MAGIC, 12, int)
+
+// Verdicts of BPF_MODIFY_RETURN programs attached to the module's
+// morsecode_filter_message() (Linux 6.9 and later). It runs on every message
+// after normalization, before it is compiled. A program may replace the text
+// with the bpf_morsecode_set_text() kfunc, read it with
+// bpf_morsecode_get_text(), and return ACCEPT to queue the (rewritten)
+// message, DROP to complete it at once without flashing, or a negative
+// errno to fail the submission with it. The result is normalized again.
+// Both kfuncs take the ctx the program was called with, and return -EINVAL
+// for any other pointer.
+#define MORSECODE_FILTER_ACCEPT 0
+#define MORSECODE_FILTER_DROP 1
+
+// Picks the channel a tty with the morse line discipline attached (module
+// parameter tty_ldisc, Linux 6.6 and later) queues its lines on; ioctl on
+// the tty itself. Channel 0 by default. Attaching the discipline and this
+// ioctl both need CAP_SYS_ADMIN.
+#define MORSECODE_IOC_TTY_CHANNEL _IOW(MORSECODE_IOC_MAGIC, 13, int)
+
+// Affinity of a file on /dev/morse-code-any, which sends each message to the
+// channel with the least airtime queued. Only channels whose tags (the
+// channel's tags attribute in sysfs) include every bit set here are used;
+// 0, the default, allows any channel. MORSECODE_IOC_SET_PRIORITY works there
+// too.
+#define MORSECODE_IOC_SET_AFFINITY _IOW(MORSECODE_IOC_MAGIC, 14, __u32)
+
+// io_uring passthrough (IORING_OP_URING_CMD, Linux 6.7 and later). cmd_op
+// is one of MORSECODE_IOC_SUBMIT, _CANCEL, _FLUSH or _STATS and the SQE's
+// command area holds a morsecode_uring_cmd with the pointer the ioctl would
+// take. Cancel, flush and stats complete at once with the ioctl's result.
+// A submit completes only when its message is done: res is 0 once it has
+// been flashed, or a negative error. If the ring is torn down first, a
+// message not yet on air is taken off the queue and res is -ECANCELED.
+struct morsecode_uring_cmd {
+	__u64 arg;
+};
+
+#endif